@@ -0,0 +1,191 @@
+//
+//		cf.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * CF pulse output counting
+ *
+ * The 90E24 outputs one CF1 pulse per 1/MC kWh of active energy and one
+ * CF2 pulse per 1/MC kvarh of reactive energy. CF1 is timestamped by the 
+ * Timer1 input capture unit, CF2 by a pin change interrupt reading 
+ * Timer1. Timer1 runs at F_CPU/64 and is extended to 32 bits by counting 
+ * overflows.
+ *
+ * The time between the last two pulses gives the instantaneous power. 
+ * If no pulse has arrived for longer than that, the time since the last 
+ * pulse is used instead, so the reading decays when the load drops.
+ * A channel times out when there has been no pulse for CF_TIMEOUT_SEC.
+ */
+
+#include "includes.h"
+
+#ifdef EM_CF_PULSE
+
+#define CF_TIMEOUT_TICKS (CF_TIMEOUT_SEC * CF_TICKS_PER_SEC)
+
+typedef struct {
+	uint32_t last;								// Timestamp of the last pulse
+	uint32_t period;							// Ticks between the last two pulses
+	uint16_t pulses;							// Pulses not yet taken
+	uint8_t state;								// Number of pulse timestamps held (0-2)
+} cf_channel_t;
+
+static volatile uint16_t cf_ovf;
+static volatile cf_channel_t cf_chan[CF_CHANNELS];
+static uint8_t cf2_level;
+
+/*
+ * Extend a Timer1 count to 32 bits. Interrupts must be disabled.
+ *
+ * A pending overflow which has not been counted yet belongs to the 
+ * count if the count is from after the overflow.
+ */
+
+static uint32_t cf_timestamp(uint16_t count)
+{
+	uint16_t ovf = cf_ovf;
+	
+	if((TIFR1 & _BV(TOV1)) && (count < 0x8000))
+		ovf++;
+	return (((uint32_t) ovf) << 16) | count;
+}
+
+/*
+ * Record a pulse on a channel. Interrupts must be disabled.
+ */
+
+static void cf_pulse(volatile cf_channel_t *ch, uint32_t stamp)
+{
+	if(ch->state){
+		ch->period = stamp - ch->last;
+		ch->state = 2;
+	}
+	else
+		ch->state = 1;
+	ch->last = stamp;
+	ch->pulses++;
+}
+
+/*
+ * CF1 input capture
+ */
+
+ISR(TIMER1_CAPT_vect)
+{
+	cf_pulse(&cf_chan[CF_ACTIVE], cf_timestamp(ICR1));
+}
+
+/*
+ * CF2 pin change, count the rising edge only
+ */
+ 
+ISR(PCINT1_vect)
+{
+	uint16_t count = TCNT1;
+	uint8_t level = CF2_PINPORT & _BV(CF2_PIN);
+	
+	if(level && !cf2_level)
+		cf_pulse(&cf_chan[CF_REACTIVE], cf_timestamp(count));
+	cf2_level = level;
+}
+
+/*
+ * Timer1 overflow, extend the count and time out idle channels
+ */
+ 
+ISR(TIMER1_OVF_vect)
+{
+	uint8_t i;
+	uint32_t now;
+	
+	cf_ovf++;
+	now = ((uint32_t) cf_ovf) << 16;
+	
+	for(i = 0; i < CF_CHANNELS; i++){
+		if(cf_chan[i].state && ((now - cf_chan[i].last) > CF_TIMEOUT_TICKS))
+			cf_chan[i].state = 0;
+	}
+}
+
+/*
+ * Initialize Timer1 and the CF inputs
+ */
+ 
+void cf_init(void)
+{
+	// Inputs
+	CF1_DDR &= ~_BV(CF1_PIN);
+	CF2_DDR &= ~_BV(CF2_PIN);
+	cf2_level = CF2_PINPORT & _BV(CF2_PIN);
+
+	// Timer1 normal mode, F_CPU/64, capture on the rising edge with noise canceler
+	TCCR1A = 0;
+	TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS11) | _BV(CS10);
+	TIFR1 = _BV(ICF1) | _BV(TOV1);
+	TIMSK1 = _BV(ICIE1) | _BV(TOIE1);
+	
+	// CF2 pin change interrupt
+	CF2_PCMSK |= _BV(CF2_PCINT);
+	PCIFR = _BV(PCIF1);
+	PCICR |= _BV(PCIE1);
+}
+
+/*
+ * Return the number of pulses on a channel since the last call
+ */
+
+uint16_t cf_take_pulses(uint8_t chan)
+{
+	uint16_t pulses;
+	
+	if(chan >= CF_CHANNELS)
+		return 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		pulses = cf_chan[chan].pulses;
+		cf_chan[chan].pulses = 0;
+	}
+	return pulses;
+}
+
+/*
+ * Return the current pulse period of a channel in Timer1 ticks.
+ * 
+ * Returns 0 if the period is not known, or the channel has timed out.
+ */
+
+uint32_t cf_period(uint8_t chan)
+{
+	uint32_t elapsed, period;
+	uint8_t state;
+	
+	if(chan >= CF_CHANNELS)
+		return 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		state = cf_chan[chan].state;
+		period = cf_chan[chan].period;
+		elapsed = cf_timestamp(TCNT1) - cf_chan[chan].last;
+	}
+	if(state < 2)
+		return 0;
+	return (elapsed > period) ? elapsed : period;
+}
+
+#endif
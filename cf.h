@@ -0,0 +1,18 @@
+#ifndef CF_H
+#define CF_H
+
+// CF pulse channels
+
+enum {CF_ACTIVE = 0, CF_REACTIVE, CF_CHANNELS};
+
+// Timer1 ticks per second (F_CPU/64, 4us at 16MHz)
+
+#define CF_TICKS_PER_SEC (F_CPU / 64UL)
+
+// Methods
+
+void cf_init(void);
+uint16_t cf_take_pulses(uint8_t chan);
+uint32_t cf_period(uint8_t chan);
+
+#endif
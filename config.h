@@ -0,0 +1,148 @@
+//
+//		config.h
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * Build time options
+ *
+ * These can be overridden from the make command line, e.g.:
+ *
+ * make DOGDEFS=-DEM_SPI_SOFT
+ */
+
+/*
+ * EM chip SPI backend
+ *
+ * By default the 90E24 shares the hardware SPI peripheral with the display
+ * and uses a chip select (see pins.h). Define EM_SPI_SOFT to bit-bang the
+ * chip in 3 wire mode on the original PORTD pins instead. The serial port
+ * is then limited to 115200 baud.
+ */
+ 
+//#define EM_SPI_SOFT
+
+/*
+ * Verified EM chip block transfers
+ *
+ * When defined, em_write_block() and em_read_block() check every register
+ * against the chip's LASTSPIDATA echo and retry on a mismatch.
+ */
+ 
+#define EM_VERIFY
+
+/*
+ * Serial port
+ *
+ * The port starts at 9600 baud. The baud command switches to a faster
+ * rate, which the host must confirm at the new rate within 
+ * SERIAL_CONFIRM_MS, or the meter goes back to the old one. A confirmed
+ * rate is saved in EEPROM and used from then on.
+ */
+
+#define SERIAL_CONFIRM_MS 2000
+
+/*
+ * CF pulse energy counting
+ *
+ * When defined, energy is counted from the 90E24 CF1 pulse output instead
+ * of polling the energy register, and power at low load is derived from
+ * the time between pulses. Needs CF1 wired to ICP1 and CF2 to PC0
+ * (see pins.h). Uses Timer1.
+ *
+ * CF_TIMEOUT_SEC is how long without a pulse before the pulse derived
+ * power reads zero.
+ */
+
+//#define EM_CF_PULSE
+#define CF_TIMEOUT_SEC 1200UL
+
+/*
+ * Measurement statistics
+ *
+ * When defined, the min, max, mean and variance of Vrms, Irms, kW, kVA,
+ * PF and Hz are kept over three windows. Uses about 550 bytes of RAM,
+ * which doesn't leave the stack enough room alongside everything else, 
+ * so it is off by default. Turn something else off to make room, and 
+ * check the RAM budget the build reports (see Makefile).
+ *
+ * STATS_WINDOW0-2 are the window lengths in seconds, shortest first. Each
+ * must be a multiple of the one before it.
+ */
+
+//#define METER_STATS
+#define STATS_WINDOW0 1
+#define STATS_WINDOW1 60
+#define STATS_WINDOW2 900
+
+/*
+ * Demand
+ *
+ * Demand is averaged over DEMAND_SUBINTS sub-intervals of DEMAND_SUBINT_SEC
+ * seconds each (at most 255). When DEMAND_SLIDING is defined, the interval
+ * slides by one sub-interval at a time, otherwise it is a fixed block.
+ */
+
+#define DEMAND_SUBINT_SEC 60
+#define DEMAND_SUBINTS 15
+//#define DEMAND_SLIDING
+
+/*
+ * Energy persistence
+ *
+ * The kWh total is saved to a wear levelled log in ENERGY_LOG_SIZE
+ * bytes of EEPROM whenever it has grown by ENERGY_SAVE_WH watt hours.
+ *
+ * When POWERFAIL_WARN is defined, it is also saved when the analog 
+ * comparator sees the unregulated supply fall. Needs the supply divided
+ * down to about 1.5V on PC1 (see pins.h), and enough hold up time on the
+ * regulator to finish a pass of the main loop and the write (about 30ms).
+ */
+
+#define ENERGY_LOG_SIZE 768
+#define ENERGY_SAVE_WH 10
+//#define POWERFAIL_WARN
+
+/*
+ * Power quality events
+ *
+ * Sags and swells are relative to EVENT_NOMINAL_V, and over current is
+ * above EVENT_OVERCURRENT_A. An event ends when the reading is back past 
+ * its threshold by EVENT_HYST_PCT of nominal. The last EVENTS_MAX events
+ * are kept in RAM.
+ *
+ * When EVENTS_EEPROM is defined, events are also saved to EVENTS_EE_SIZE
+ * bytes of EEPROM (15 bytes per event). 96 bytes is what fits next to 
+ * the energy log.
+ */
+
+#define EVENT_NOMINAL_V 240
+#define EVENT_SAG_PCT 90
+#define EVENT_SWELL_PCT 110
+#define EVENT_HYST_PCT 2
+#define EVENT_OVERCURRENT_A 60
+#define EVENTS_MAX 8
+//#define EVENTS_EEPROM
+#define EVENTS_EE_SIZE 96
+
+#endif
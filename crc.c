@@ -0,0 +1,55 @@
+//
+//		crc.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+#include "includes.h"
+
+/*
+ * Add a byte to a CRC using polynomial: X^16 + X^12 + X^5 + 1
+ */
+ 
+uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+	uint8_t i;
+	
+	crc ^= (((uint16_t) data) << 8);
+	for ( i = 0 ; i < 8 ; ++i ){
+		if (crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+	return crc;
+}
+
+/* 
+ * Calculate CRC over buffer using polynomial: X^16 + X^12 + X^5 + 1 
+ */
+
+uint16_t calcCRC16(const void *buf, int len)
+{
+	uint16_t crc = 0;
+	const uint8_t *b = (const uint8_t *) buf;
+	
+	while(len--)
+		crc = crc16_update(crc, *b++);
+	return crc;
+}
@@ -0,0 +1,9 @@
+#ifndef CRC_H
+#define CRC_H
+
+// Methods
+
+uint16_t crc16_update(uint16_t crc, uint8_t data);
+uint16_t calcCRC16(const void *buf, int len);
+
+#endif
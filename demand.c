@@ -0,0 +1,167 @@
+//
+//		demand.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Block demand
+ *
+ * Demand is the energy delivered over an interval of DEMAND_SUBINTS
+ * sub-intervals of DEMAND_SUBINT_SEC seconds each (see config.h). The
+ * energy of the most recent sub-intervals is kept in a ring with a
+ * running total, so each sub-interval costs the same whatever the
+ * interval length.
+ *
+ * With DEMAND_SLIDING defined, the interval slides by one sub-interval 
+ * at a time. Otherwise it is a fixed block which restarts every 
+ * interval.
+ *
+ * Energy is in the caller's units, the caller converts to power.
+ */
+
+#include "includes.h"
+
+static uint32_t demand_ring[DEMAND_SUBINTS];	// Energy per sub-interval
+static uint32_t demand_sum;						// Sum of the ring
+static uint32_t demand_partial;					// Energy in the sub-interval in progress
+static uint32_t demand_start;					// Tick count when the sub-interval started
+static uint32_t demand_last_energy;				// Energy in the last completed interval
+static uint8_t demand_head;						// Oldest ring entry, next to be replaced
+static uint8_t demand_filled;					// Number of completed sub-intervals in the ring
+static uint16_t demand_boot;					// Power up count
+static demand_peak_t demand_peak_rec;			// Peak interval
+
+/*
+ * Initialize with the saved peak and the power up count
+ */
+ 
+void demand_init(const demand_peak_t *peak, uint16_t boot)
+{
+	demand_peak_rec = *peak;
+	demand_boot = boot;
+	demand_start = timer0_ticks();
+}
+
+/*
+ * Add energy to the sub-interval in progress
+ */
+ 
+void demand_add(uint32_t energy)
+{
+	demand_partial += energy;
+}
+
+/*
+ * Close the sub-interval when it is due. Call often.
+ * 
+ * Returns TRUE when a new peak was set
+ */
+ 
+bool demand_service(void)
+{
+	uint32_t now = timer0_ticks();
+	uint32_t len = timer0_ms_to_ticks(DEMAND_SUBINT_SEC * 1000UL);
+	
+	if((now - demand_start) < len)
+		return FALSE;
+	demand_start += len;
+	// Catch up after a long stall
+	if((now - demand_start) >= len)
+		demand_start = now;
+		
+	// Replace the oldest sub-interval
+	demand_sum += demand_partial - demand_ring[demand_head];
+	demand_ring[demand_head] = demand_partial;
+	demand_partial = 0;
+	if(++demand_head >= DEMAND_SUBINTS)
+		demand_head = 0;
+	if(demand_filled < DEMAND_SUBINTS)
+		demand_filled++;
+		
+#ifdef DEMAND_SLIDING
+	if(demand_filled < DEMAND_SUBINTS)
+		return FALSE;
+#else
+	// The head wraps at the end of each block
+	if(demand_head || (demand_filled < DEMAND_SUBINTS))
+		return FALSE;
+#endif
+
+	// An interval is complete
+	demand_last_energy = demand_sum;
+	if(demand_sum <= demand_peak_rec.energy)
+		return FALSE;
+	demand_peak_rec.energy = demand_sum;
+	demand_peak_rec.secs = timer0_seconds();
+	demand_peak_rec.boot = demand_boot;
+	return TRUE;
+}
+
+/*
+ * Return the energy so far in the interval in progress
+ */
+ 
+uint32_t demand_current(void)
+{
+#ifdef DEMAND_SLIDING
+	// The oldest sub-interval drops out when this one completes
+	if(demand_filled == DEMAND_SUBINTS)
+		return demand_sum - demand_ring[demand_head] + demand_partial;
+	return demand_sum + demand_partial;
+#else
+	uint32_t sum = demand_partial;
+	uint8_t i;
+	
+	// The sub-intervals of this block are the ones before the head
+	for(i = 0; i < demand_head; i++)
+		sum += demand_ring[i];
+	return sum;
+#endif
+}
+
+/*
+ * Get the energy in the last completed interval
+ * 
+ * Returns FALSE if no interval has completed yet
+ */
+ 
+bool demand_last(uint32_t *energy)
+{
+	*energy = demand_last_energy;
+	return (demand_filled == DEMAND_SUBINTS);
+}
+
+/*
+ * Return the peak interval
+ */
+ 
+const demand_peak_t *demand_peak(void)
+{
+	return &demand_peak_rec;
+}
+
+/*
+ * Clear the peak
+ */
+ 
+void demand_reset_peak(void)
+{
+	memset(&demand_peak_rec, 0, sizeof(demand_peak_rec));
+}
@@ -0,0 +1,22 @@
+#ifndef DEMAND_H
+#define DEMAND_H
+
+// Peak demand, persisted by the caller
+
+typedef struct {
+	uint32_t energy;							// Energy in the peak interval
+	uint32_t secs;								// Seconds since power up at the end of the interval
+	uint16_t boot;								// Power up count when the peak was set
+} demand_peak_t;
+
+// Methods
+
+void demand_init(const demand_peak_t *peak, uint16_t boot);
+void demand_add(uint32_t energy);
+bool demand_service(void);
+uint32_t demand_current(void);
+bool demand_last(uint32_t *energy);
+const demand_peak_t *demand_peak(void);
+void demand_reset_peak(void);
+
+#endif
@@ -0,0 +1,161 @@
+//
+//		dispatch.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+
+/*
+ * JSON command dispatch
+ *
+ * Commands are in a table in program memory, with their name lengths 
+ * and argument keys. A name hashes to one of DISPATCH_SLOTS slots, and 
+ * a map in RAM, built once at start up, gives the command in each slot.
+ * Finding a command costs one hash of the name and normally one string
+ * compare, however many commands there are. A slot collision moves the
+ * later command to the next free slot. DISPATCH_SEED is chosen so the
+ * current commands don't collide.
+ */
+
+#include "includes.h"
+
+#define DISPATCH_SEED 42
+
+/*
+ * Add a character to a name hash
+ */
+ 
+static inline uint8_t dispatch_hash_step(uint8_t h, char c)
+{
+	return (h ^ (uint8_t) c) * 5;
+}
+
+/*
+ * Return the first slot to try for a hash
+ */
+ 
+static inline uint8_t dispatch_first_slot(uint8_t h)
+{
+	return h >> 3;
+}
+
+/*
+ * Hash a command name
+ */
+ 
+uint8_t dispatch_hash(const char *name, uint8_t len)
+{
+	uint8_t h = DISPATCH_SEED;
+	
+	while(len--)
+		h = dispatch_hash_step(h, *name++);
+	return h;
+}
+
+/*
+ * Build the slot map for a command table in program memory
+ */
+ 
+void dispatch_init(dispatch_t *d, const dispatch_cmd_t *table, uint8_t count)
+{
+	PGM_P name;
+	uint8_t i, j, len, h;
+	
+	d->table = table;
+	memset(d->slot, 0, sizeof(d->slot));
+	for(i = 0; (i < count) && (i < DISPATCH_SLOTS); i++){
+		name = (PGM_P) pgm_read_ptr(&table[i].name);
+		len = pgm_read_byte(&table[i].len);
+		h = DISPATCH_SEED;
+		for(j = 0; j < len; j++)
+			h = dispatch_hash_step(h, pgm_read_byte(&name[j]));
+		for(j = dispatch_first_slot(h); d->slot[j]; j = (j + 1) & (DISPATCH_SLOTS - 1));
+		d->slot[j] = i + 1;
+	}
+}
+
+/*
+ * Find a command by name, and copy its table entry to cmd.
+ * 
+ * Returns FALSE if there is no such command
+ */
+ 
+bool dispatch_find(const dispatch_t *d, const char *name, uint8_t len, dispatch_cmd_t *cmd)
+{
+	uint8_t j;
+	
+	for(j = dispatch_first_slot(dispatch_hash(name, len)); d->slot[j]; j = (j + 1) & (DISPATCH_SLOTS - 1)){
+		memcpy_P(cmd, &d->table[d->slot[j] - 1], sizeof(dispatch_cmd_t));
+		if((cmd->len == len) && !strncmp_P(name, cmd->name, len))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Test for a key in a comma separated list in program memory
+ */
+ 
+static bool dispatch_listed(PGM_P list, const char *key, uint8_t len)
+{
+	bool match = TRUE;
+	uint8_t n = 0;
+	char c;
+	
+	if(!list)
+		return FALSE;
+	do{
+		c = pgm_read_byte(list++);
+		if(!c || (',' == c)){
+			if(match && (n == len))
+				return TRUE;
+			match = TRUE;
+			n = 0;
+		}
+		else{
+			if((n >= len) || (key[n] != c))
+				match = FALSE;
+			n++;
+		}
+	} while(c);
+	return FALSE;
+}
+
+/*
+ * Check the keys of a command object against the command's arguments.
+ * 
+ * Returns FALSE if there is a key other than "command" or "id" which 
+ * the command doesn't take
+ */
+ 
+bool dispatch_args_ok(const dispatch_cmd_t *cmd, const char *line, jsmntok_t *tokens, uint8_t ntokens)
+{
+	const char *key;
+	uint8_t i, len;
+	
+	for(i = 1; (i < ntokens) && (JSMN_STRING == tokens[i].type); i += 2){
+		key = line + tokens[i].start;
+		len = tokens[i].end - tokens[i].start;
+		if(dispatch_listed(PSTR("command,id"), key, len))
+			continue;
+		if(!dispatch_listed(cmd->args, key, len))
+			return FALSE;
+	}
+	return TRUE;
+}
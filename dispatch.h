@@ -0,0 +1,29 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+// Hash slots, a power of 2 with room for every command
+
+#define DISPATCH_SLOTS 32
+
+typedef void (*dispatch_fn_t)(const char *line, jsmntok_t *tokens);
+
+typedef struct {
+	PGM_P name;									// Command name
+	uint8_t len;								// Length of the name
+	dispatch_fn_t fn;							// Handler
+	PGM_P args;									// Argument keys, comma separated, NULL if none
+} dispatch_cmd_t;
+
+typedef struct {
+	const dispatch_cmd_t *table;				// Commands, in program memory
+	uint8_t slot[DISPATCH_SLOTS];				// Table index + 1 of the command in each slot, 0 if free
+} dispatch_t;
+
+// Methods
+
+uint8_t dispatch_hash(const char *name, uint8_t len);
+void dispatch_init(dispatch_t *d, const dispatch_cmd_t *table, uint8_t count);
+bool dispatch_find(const dispatch_t *d, const char *name, uint8_t len, dispatch_cmd_t *cmd);
+bool dispatch_args_ok(const dispatch_cmd_t *cmd, const char *line, jsmntok_t *tokens, uint8_t ntokens);
+
+#endif
@@ -0,0 +1,171 @@
+//
+//		eelog.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Wear levelled EEPROM record logs
+ *
+ * A log divides an area of EEPROM into slots of one record each. A record
+ * is a sequence number, the payload, and a CRC over both. Each write goes
+ * to the slot after the newest record with the next sequence number, so
+ * the writes are spread over all the slots, and the older records stay
+ * readable until they are overwritten.
+ *
+ * At startup the newest record is the valid one with the highest 
+ * sequence number, found in a single scan. A record torn by a power 
+ * failure fails its CRC, which leaves the one before it as the newest.
+ *
+ * The CRC is stored inverted, so neither blank (0xFF) nor zeroed 
+ * EEPROM reads as a valid record.
+ */
+
+#include "includes.h"
+
+#define EELOG_OVERHEAD (sizeof(uint16_t) * 2)
+
+/*
+ * Return the EEPROM address of a slot
+ */
+ 
+static uint8_t *eelog_slot(const eelog_t *log, uint16_t slot)
+{
+	return log->eemem + (slot * (log->len + EELOG_OVERHEAD));
+}
+
+/*
+ * Check the record in a slot, return its sequence number in *seq
+ */
+ 
+static bool eelog_check(const eelog_t *log, uint16_t slot, uint16_t *seq)
+{
+	uint8_t *p = eelog_slot(log, slot);
+	uint16_t crc = 0;
+	uint8_t i;
+	
+	for(i = 0; i < log->len + sizeof(uint16_t); i++)
+		crc = crc16_update(crc, eeprom_read_byte(p++));
+	*seq = eeprom_read_word((const uint16_t *) eelog_slot(log, slot));
+	crc = ~crc;
+	return (crc == eeprom_read_word((const uint16_t *) p));
+}
+
+/*
+ * Set up a log in size bytes of EEPROM, and find the newest record
+ * 
+ * Returns TRUE if there is one
+ */
+ 
+bool eelog_init(eelog_t *log, uint8_t *eemem, uint16_t size, uint8_t len)
+{
+	uint16_t slot, seq;
+	
+	if(len > EELOG_PAYLOAD_MAX)
+		len = EELOG_PAYLOAD_MAX;
+	log->eemem = eemem;
+	log->len = len;
+	log->slots = size / (len + EELOG_OVERHEAD);
+	log->valid = FALSE;
+	log->newest = log->slots - 1; // So the first write goes to slot 0
+	
+	for(slot = 0; slot < log->slots; slot++){
+		if(!eelog_check(log, slot, &seq))
+			continue;
+		// Sequence numbers wrap, compare the difference
+		if(!log->valid || ((int16_t) (seq - log->seq) > 0)){
+			log->valid = TRUE;
+			log->newest = slot;
+			log->seq = seq;
+		}
+	}
+	return log->valid;
+}
+
+/*
+ * Read the payload of the newest record
+ * 
+ * Returns FALSE if there is none
+ */
+ 
+bool eelog_read(const eelog_t *log, void *payload)
+{
+	return eelog_read_back(log, 0, payload);
+}
+
+/*
+ * Read the payload of an older record, age records before the newest
+ * 
+ * Returns FALSE if there is no such record
+ */
+ 
+bool eelog_read_back(const eelog_t *log, uint16_t age, void *payload)
+{
+	uint16_t slot, seq;
+	
+	if(!log->valid || (age >= log->slots))
+		return FALSE;
+	slot = (log->newest >= age) ? log->newest - age : log->newest + log->slots - age;
+	// Must be valid and in sequence with the newest
+	if(!eelog_check(log, slot, &seq) || (seq != (uint16_t) (log->seq - age)))
+		return FALSE;
+	eeprom_read_block(payload, eelog_slot(log, slot) + sizeof(uint16_t), log->len);
+	return TRUE;
+}
+
+/*
+ * Write a new record
+ */
+ 
+void eelog_write(eelog_t *log, const void *payload)
+{
+	uint16_t slot = log->newest + 1;
+	uint16_t seq = log->seq + 1;
+	uint16_t crc = 0;
+	const uint8_t *b = (const uint8_t *) payload;
+	uint8_t *p;
+	uint8_t i;
+	
+	if(slot >= log->slots)
+		slot = 0;
+	
+	crc = crc16_update(crc, (uint8_t) seq);
+	crc = crc16_update(crc, (uint8_t) (seq >> 8));
+	for(i = 0; i < log->len; i++)
+		crc = crc16_update(crc, b[i]);
+	crc = ~crc;
+		
+	p = eelog_slot(log, slot);
+	eeprom_update_word((uint16_t *) p, seq);
+	eeprom_update_block(payload, p + sizeof(uint16_t), log->len);
+	eeprom_update_word((uint16_t *) (p + sizeof(uint16_t) + log->len), crc);
+	
+	log->newest = slot;
+	log->seq = seq;
+	log->valid = TRUE;
+}
+
+/*
+ * Return the sequence number of the newest record
+ */
+ 
+uint16_t eelog_sequence(const eelog_t *log)
+{
+	return log->seq;
+}
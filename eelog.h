@@ -0,0 +1,27 @@
+#ifndef EELOG_H
+#define EELOG_H
+
+// Largest payload
+
+#define EELOG_PAYLOAD_MAX 96
+
+// A log in an area of EEPROM
+
+typedef struct {
+	uint8_t *eemem;								// EEPROM area
+	uint16_t slots;								// Number of slots
+	uint16_t newest;							// Slot of the newest record
+	uint16_t seq;								// Sequence number of the newest record
+	uint8_t len;								// Payload length
+	bool valid;									// TRUE if there is a newest record
+} eelog_t;
+
+// Methods
+
+bool eelog_init(eelog_t *log, uint8_t *eemem, uint16_t size, uint8_t len);
+bool eelog_read(const eelog_t *log, void *payload);
+bool eelog_read_back(const eelog_t *log, uint16_t age, void *payload);
+void eelog_write(eelog_t *log, const void *payload);
+uint16_t eelog_sequence(const eelog_t *log);
+
+#endif
@@ -19,6 +19,8 @@
 #include "includes.h"
  
 #ifdef __AVR__
+
+#ifdef EM_SPI_SOFT
  
 	#define SCLK_HIGH EM_SCLK_PORT |= _BV(EM_SCLK_PIN)
 	#define SCLK_LOW EM_SCLK_PORT &= ~_BV(EM_SCLK_PIN)
@@ -29,13 +31,134 @@
  
 	#define MISO_STATE (((EM_MISO_PINPORT & _BV(EM_MISO_PIN)) > 0))
  
-	#define CLK_DELAY _delay_us(5)
-	#define START_DELAY _delay_us(500)
+	// Delays come from the selected timing profile
+	#define CLK_DELAY _delay_loop_1(em_clk_loops)
+	#define START_DELAY _delay_loop_2(em_start_loops)
+	
+	// Timing profile
+	typedef struct {
+		uint8_t clk_loops;						// Half clock delay, _delay_loop_1() counts (3 cycles each)
+		uint16_t start_loops;					// Start condition delay, _delay_loop_2() counts (4 cycles each)
+		uint16_t khz;							// Nominal SCLK frequency
+	} em_timing_t;
+	
+	// Timing profiles, slowest first. Profile 0 is the original 5us/500us timing.
+	static const em_timing_t em_timings[] PROGMEM = {
+		{(F_CPU / 3000000UL) * 5, (F_CPU / 4000000UL) * 500, 100},
+		{(F_CPU / 3000000UL) * 5 / 2, (F_CPU / 4000000UL) * 400, 190},
+		{(F_CPU / 3000000UL) * 5 / 4, (F_CPU / 4000000UL) * 300, 350},
+		{(F_CPU / 3000000UL) * 5 / 8, (F_CPU / 4000000UL) * 200, 600},
+		{1, (F_CPU / 4000000UL) * 100, 900}
+	};
+	
+	static uint8_t em_clk_loops = (F_CPU / 3000000UL) * 5;
+	static uint16_t em_start_loops = (F_CPU / 4000000UL) * 500;
+	
+	// 3 wire bus in use
+	static volatile bool em_locked;
+	
+#else
+
+	// SPI mode 3, clock rate comes from the timing profile
+	#define EM_SPCR (_BV(SPE) | _BV(MSTR) | _BV(CPOL) | _BV(CPHA))
 
+	static spi_device_t em_spi = {
+		.spcr = (EM_SPCR | _BV(SPR1) | _BV(SPR0)),
+		.spsr = 0,
+		.cs_port = &EM_CS_PORT,
+		.cs_mask = _BV(EM_CS_PIN),
+		.cs_active_high = FALSE
+	};
+	
+	// Timing profile
+	typedef struct {
+		uint8_t spcr;							// SPR1 and SPR0 bits
+		uint8_t spsr;							// SPI2X bit
+		uint16_t khz;							// SCLK frequency
+	} em_timing_t;
+	
+	// Timing profiles, slowest first. Profile 0 is fclk/128.
+	static const em_timing_t em_timings[] PROGMEM = {
+		{_BV(SPR1) | _BV(SPR0), 0, F_CPU / 128000UL},
+		{_BV(SPR1), 0, F_CPU / 64000UL},
+		{_BV(SPR1), _BV(SPI2X), F_CPU / 32000UL},
+		{_BV(SPR0), 0, F_CPU / 16000UL},
+		{_BV(SPR0), _BV(SPI2X), F_CPU / 8000UL}
+	};
+	
 #endif
- 
+
+#else
+
+	// Host build, the chip is simulated (see host/em_sim.c)
+	
+	// Timing profile
+	typedef struct {
+		uint16_t khz;							// SCLK frequency
+	} em_timing_t;
+	
+	// The simulated chip has no bus timing, so there is a single profile
+	static const em_timing_t em_timings[] PROGMEM = {
+		{0}
+	};
+
+#endif
+
+// Number of retries for a verified transaction
+#define EM_VERIFY_RETRIES 3
+
+// Number of passes over the known registers when checking a profile
+#define EM_TUNE_PASSES 8
+
+// Number of timing profiles
+#define EM_TIMING_COUNT (sizeof(em_timings) / sizeof(em_timing_t))
+
+// Selected timing profile
+static uint8_t em_timing;
+
+// Verified transaction counters
+static em_diag_t em_diag;
+
+// TRUE while a verified transaction keeps the engine from starting a batch
+static volatile bool em_paused;
+
+static void em_kick(void);
+
+// Register shadow of the configuration space
+
+#define EM_SHADOW_SIZE (EM_CS2 + 1)
+#define EM_SHADOW_BITMAP ((EM_SHADOW_SIZE + 7) / 8)
+
+// Calibration register range protected by a checksum
+typedef struct {
+	uint8_t first;								// First register
+	uint8_t last;								// Last register
+	uint8_t cs;									// Checksum register
+	uint8_t start;								// Unlock/lock register
+} em_range_t;
+
+static const em_range_t em_ranges[] PROGMEM = {
+	{EM_CAL_FIRST, EM_CAL_LAST, EM_CS1, EM_CALSTART},
+	{EM_MEAS_FIRST, EM_MEAS_LAST, EM_CS2, EM_ADJSTART}
+};
+
+#define EM_RANGE_COUNT (sizeof(em_ranges) / sizeof(em_range_t))
+
+static uint16_t em_shadow[EM_SHADOW_SIZE];			// Register values
+static uint8_t em_shadow_valid[EM_SHADOW_BITMAP];	// Shadow value is known
+static uint8_t em_shadow_dirty[EM_SHADOW_BITMAP];	// Shadow value needs writing to the chip
+static uint8_t em_cs_stale;							// Bit per range, checksum needs a full recompute
  
 
+#if !defined(__AVR__)
+
+/*
+ * Host build: em_init(), em_write_transaction() and em_read_transaction()
+ * are provided by the chip simulator.
+ */
+
+#elif defined(EM_SPI_SOFT)
+
 /*
  * Do a full duplex SPI transaction
  *
@@ -78,6 +201,44 @@
 
  }
  
+/*
+ * Try to take the 3 wire bus.
+ * 
+ * Keeps the transaction engine and foreground transactions apart.
+ */
+ 
+ static bool em_try_lock(void)
+ {
+	 ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		 if(em_locked)
+			return FALSE;
+		 em_locked = TRUE;
+	 }
+	 return TRUE;
+ }
+ 
+/*
+ * Start a transaction.
+ * 
+ * In 3 wire mode the chip needs to see SCLK low for a while.
+ */
+ 
+ static void em_start(void)
+ {
+	 while(FALSE == em_try_lock());
+	 SCLK_LOW;
+	 START_DELAY;
+ }
+ 
+/*
+ * End a transaction
+ */
+ 
+ static void em_end(void)
+ {
+	 em_locked = FALSE;
+ }
+ 
 /*
  * Initialize I/O pins
  */
@@ -103,6 +264,54 @@
 	 
  }
  
+#else
+
+/*
+ * Do a full duplex byte transfer on the hardware SPI bus
+ */
+ 
+ static uint16_t em_transact_byte(uint8_t out_byte)
+ {
+	 return (uint16_t) spi_transfer(out_byte);
+ }
+ 
+/*
+ * Start a transaction.
+ * 
+ * In 4 wire mode the chip select frames the transaction,
+ * so there is no start delay.
+ */
+ 
+ static void em_start(void)
+ {
+	 spi_acquire(&em_spi);
+	 spi_select(&em_spi, TRUE);
+ }
+ 
+/*
+ * End a transaction
+ */
+ 
+ static void em_end(void)
+ {
+	 spi_select(&em_spi, FALSE);
+	 spi_release(&em_spi);
+ }
+ 
+/*
+ * Initialize the chip select. Must be called before any other
+ * device uses the bus so the chip does not see their traffic.
+ */
+ 
+ void em_init(void)
+ {
+	 spi_add_device(&em_spi, &EM_CS_DDR);
+ }
+ 
+#endif
+
+#ifdef __AVR__
+ 
  /*
   * Do a write transaction
   */
@@ -110,12 +319,12 @@
  void em_write_transaction(uint8_t addr, uint16_t data)
  {
 	 // Tell the chip we want to start a transaction
-	 SCLK_LOW;
-	 START_DELAY;
+	 em_start();
 	 // Clock out the address, and the 16 bit data to the chip
 	 em_transact_byte(addr);
 	 em_transact_byte((uint8_t) (data >> 8));
 	 em_transact_byte((uint8_t) data);
+	 em_end();
  }
  
  /*
@@ -127,17 +336,180 @@
 	 uint16_t res;
  
 	 // Tell the chip we want to start a transaction
-	 SCLK_LOW;
-	 START_DELAY;
+	 em_start();
 	 // Clock out the address to the chip
-	 em_transact_byte(addr | 0x80);
+	 em_transact_byte(addr | EM_READ);
 	 //Clock in the 16 bit data from the chip
 	 res = (em_transact_byte(0) << 8);
 	 res |= em_transact_byte(0);
+	 em_end();
 	 // Return the result
 	 return res;
  }
  
+#endif
+ 
+/*
+ * Pause or resume the transaction engine.
+ * 
+ * While paused the engine starts no new batch, so a snapshot can't run
+ * between a transaction and its LASTSPIDATA readback. A batch already 
+ * running finishes first, as the foreground waits for the bus.
+ */
+ 
+static void em_pause(bool pause)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		em_paused = pause;
+		if(!pause)
+			em_kick();
+	}
+}
+
+/*
+ * Do a write transaction and check that the chip received it.
+ * 
+ * LASTSPIDATA holds the data of the last transaction, so it must echo
+ * what was written. Retries on a mismatch.
+ * 
+ * Returns TRUE if the write was verified.
+ */
+ 
+bool em_write_verified(uint8_t addr, uint16_t data)
+{
+	uint8_t try;
+	bool res = FALSE;
+	
+	em_pause(TRUE);
+	for(try = 0; try <= EM_VERIFY_RETRIES; try++){
+		if(try)
+			em_diag.retries++;
+		em_write_transaction(addr, data);
+		if(em_read_transaction(EM_LASTSPIDATA) == data){
+			res = TRUE;
+			break;
+		}
+	}
+	em_pause(FALSE);
+	if(res)
+		em_diag.verified++;
+	else
+		em_diag.failures++;
+	return res;
+}
+
+/*
+ * Do a read transaction and check that it arrived intact.
+ * 
+ * Returns TRUE if the value read was echoed by LASTSPIDATA.
+ * On failure *data holds the last value read.
+ */
+ 
+bool em_read_verified(uint8_t addr, uint16_t *data)
+{
+	uint8_t try;
+	bool res = FALSE;
+	
+	em_pause(TRUE);
+	for(try = 0; try <= EM_VERIFY_RETRIES; try++){
+		if(try)
+			em_diag.retries++;
+		*data = em_read_transaction(addr);
+		if(em_read_transaction(EM_LASTSPIDATA) == *data){
+			res = TRUE;
+			break;
+		}
+	}
+	em_pause(FALSE);
+	if(res)
+		em_diag.verified++;
+	else
+		em_diag.failures++;
+	return res;
+}
+
+/*
+ * Return the verified transaction counters
+ */
+ 
+const em_diag_t *em_get_diag(void)
+{
+	return &em_diag;
+}
+
+/*
+ * Test a bit in a shadow bitmap
+ */
+ 
+static bool em_bit_test(const uint8_t *bitmap, uint8_t addr)
+{
+	return (bitmap[addr >> 3] & _BV(addr & 7)) ? TRUE : FALSE;
+}
+
+/*
+ * Set or clear a bit in a shadow bitmap
+ */
+ 
+static void em_bit_set(uint8_t *bitmap, uint8_t addr, bool state)
+{
+	if(state)
+		bitmap[addr >> 3] |= _BV(addr & 7);
+	else
+		bitmap[addr >> 3] &= ~_BV(addr & 7);
+}
+
+/*
+ * Return TRUE if a register can be held in the shadow.
+ * 
+ * Status, command and reset registers always go to the chip.
+ */
+
+static bool em_reg_cached(uint8_t addr)
+{
+	if((addr >= EM_FUNCEN) && (addr <= EM_SMALLPMOD))
+		return TRUE;
+	if((addr >= EM_CAL_FIRST) && (addr <= EM_CS1))
+		return TRUE;
+	if((addr >= EM_MEAS_FIRST) && (addr <= EM_CS2))
+		return TRUE;
+	return FALSE;
+}
+
+/*
+ * Return the index of the checksummed range holding a register, 
+ * or -1 if it isn't in one.
+ */
+ 
+static int8_t em_range_index(uint8_t addr)
+{
+	uint8_t i;
+	
+	for(i = 0; i < EM_RANGE_COUNT; i++){
+		if((addr >= pgm_read_byte(&em_ranges[i].first)) && 
+		(addr <= pgm_read_byte(&em_ranges[i].last)))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Store a value read from or written to the chip in the shadow
+ */
+ 
+static void em_shadow_store(uint8_t addr, uint16_t value)
+{
+	int8_t r;
+	
+	if(!em_reg_cached(addr))
+		return;
+	em_shadow[addr] = value;
+	em_bit_set(em_shadow_valid, addr, TRUE);
+	em_bit_set(em_shadow_dirty, addr, FALSE);
+	// The cached checksum no longer follows the register values
+	if((r = em_range_index(addr)) >= 0)
+		em_cs_stale |= _BV(r);
+}
+
 /*
  * Write a block of values, and calculate the checksum on the fly.
  * Return the checksum to the caller.
@@ -151,7 +523,12 @@ uint16_t em_write_block(uint8_t first, uint8_t last, uint16_t *block)
 	
 	for(i = first; i < last + 1; i++){
 		uint8_t j = i - first;
+#ifdef EM_VERIFY
+		em_write_verified(i, block[j]);
+#else
 		em_write_transaction(i, block[j]);
+#endif
+		em_shadow_store(i, block[j]);
 		// Calculate checksum on the fly
 		// Low byte is modulo 256 sum of all high and low bytes
 		cslow += (uint8_t) ((block[j] & 0xff) + (block[j] >> 8));
@@ -176,7 +553,12 @@ uint16_t em_read_block(uint8_t first, uint8_t last, uint16_t *block)
 	uint8_t i;
 	for(i = first; i < last + 1; i++){
 		uint8_t j = i - first;
+#ifdef EM_VERIFY
+		em_read_verified(i, &block[j]);
+#else
 		block[j] = em_read_transaction(i);
+#endif
+		em_shadow_store(i, block[j]);
 		// Calculate checksum on the fly
 		// Low byte is modulo 256 sum of all high and low bytes
 		cslow += (uint8_t) ((block[j] & 0xff) + (block[j] >> 8));
@@ -189,7 +571,627 @@ uint16_t em_read_block(uint8_t first, uint8_t last, uint16_t *block)
 	
 }
 
+
+/*
+ * Register shadow
+ * 
+ * The configuration registers (0x00-0x3B) are shadowed in RAM. Reads of
+ * known values are served from the shadow. Writes only update the shadow
+ * and mark the register dirty; em_reg_flush() sends the dirty registers
+ * to the chip. The CS1 and CS2 checksums are kept up to date incrementally
+ * as registers change.
+ */
+ 
+/*
+ * Read a register, using the shadow if its value is known
+ */
+ 
+uint16_t em_reg_read(uint8_t addr)
+{
+	uint16_t value;
+	
+	if(em_reg_cached(addr) && em_bit_test(em_shadow_valid, addr))
+		return em_shadow[addr];
+	value = em_read_transaction(addr);
+	em_shadow_store(addr, value);
+	return value;
+}
+
+/*
+ * Write a register.
+ * 
+ * Shadowed registers are marked dirty and written by em_reg_flush(). Other
+ * registers are written straight to the chip. Checksum registers can't be
+ * written, the shadow maintains them.
+ */
+ 
+void em_reg_write(uint8_t addr, uint16_t value)
+{
+	int8_t r;
+	uint16_t old, cs;
+	uint8_t cs_addr;
+	
+	if(!em_reg_cached(addr)){
+		em_write_verified(addr, value);
+		return;
+	}
+	if((EM_CS1 == addr) || (EM_CS2 == addr))
+		return;
+	if(em_bit_test(em_shadow_valid, addr) && (em_shadow[addr] == value))
+		return; // No change
+		
+	if((r = em_range_index(addr)) >= 0){
+		cs_addr = pgm_read_byte(&em_ranges[r].cs);
+		if(!(em_cs_stale & _BV(r)) && em_bit_test(em_shadow_valid, addr)){
+			// Update the checksum for the changed register.
+			// Low byte is the modulo 256 sum of all high and low bytes,
+			// high byte is the XOR of all high and low bytes.
+			old = em_shadow[addr];
+			cs = em_shadow[cs_addr];
+			cs = (cs & 0xFF00) | ((uint8_t) (cs - (old & 0xFF) - (old >> 8) + (value & 0xFF) + (value >> 8)));
+			cs ^= ((uint16_t) ((uint8_t) old ^ (uint8_t) (old >> 8) ^ (uint8_t) value ^ (uint8_t) (value >> 8))) << 8;
+			em_shadow[cs_addr] = cs;
+		}
+		else
+			em_cs_stale |= _BV(r);
+		em_bit_set(em_shadow_dirty, cs_addr, TRUE);
+	}
+	
+	em_shadow[addr] = value;
+	em_bit_set(em_shadow_valid, addr, TRUE);
+	em_bit_set(em_shadow_dirty, addr, TRUE);
+}
+
+/*
+ * Write a block of registers to the shadow
+ */
+ 
+void em_reg_write_block(uint8_t first, uint8_t last, const uint16_t *block)
+{
+	uint8_t i;
+	
+	for(i = first; i < last + 1; i++)
+		em_reg_write(i, block[i - first]);
+}
+
+/*
+ * Recompute a range checksum from the shadow.
+ * 
+ * Returns FALSE if a register in the range has an unknown value.
+ */
+ 
+static bool em_range_checksum(uint8_t r)
+{
+	uint8_t cshigh = 0, cslow = 0;
+	uint8_t i;
+	uint8_t last = pgm_read_byte(&em_ranges[r].last);
+	uint16_t v;
+	
+	for(i = pgm_read_byte(&em_ranges[r].first); i <= last; i++){
+		if(!em_bit_test(em_shadow_valid, i))
+			return FALSE;
+		v = em_shadow[i];
+		cslow += (uint8_t) ((v & 0xff) + (v >> 8));
+		cshigh ^= ((uint8_t) v);
+		cshigh ^= ((uint8_t) (v >> 8));
+	}
+	i = pgm_read_byte(&em_ranges[r].cs);
+	em_shadow[i] = (((uint16_t) cshigh) << 8) + cslow;
+	em_bit_set(em_shadow_valid, i, TRUE);
+	em_cs_stale &= ~_BV(r);
+	return TRUE;
+}
+
+/*
+ * Write the dirty shadow registers to the chip.
+ * 
+ * Each calibration range with changes is unlocked once, its registers 
+ * and checksum are written, and it is locked again. Unlocking resets 
+ * the whole range to its power on values, so every register in it is 
+ * written back from the shadow, not just the dirty ones.
+ * 
+ * Returns FALSE if a write could not be verified, or a range has a 
+ * register with an unknown value.
+ */
+ 
+bool em_reg_flush(void)
+{
+	bool res = TRUE;
+	uint8_t r, i, first, last, cs_addr, start;
+	bool dirty;
+	
+	// Registers outside the calibration ranges
+	for(i = EM_FUNCEN; i <= EM_SMALLPMOD; i++){
+		if(em_bit_test(em_shadow_dirty, i)){
+			res &= em_write_verified(i, em_shadow[i]);
+			em_bit_set(em_shadow_dirty, i, FALSE);
+		}
+	}
+	
+	// Calibration ranges
+	for(r = 0; r < EM_RANGE_COUNT; r++){
+		first = pgm_read_byte(&em_ranges[r].first);
+		last = pgm_read_byte(&em_ranges[r].last);
+		cs_addr = pgm_read_byte(&em_ranges[r].cs);
+		start = pgm_read_byte(&em_ranges[r].start);
 		
+		// A checksum which has never been written counts as dirty
+		dirty = em_bit_test(em_shadow_dirty, cs_addr) || !em_bit_test(em_shadow_valid, cs_addr);
+		for(i = first; i <= last; i++)
+			dirty |= em_bit_test(em_shadow_dirty, i);
+		if(!dirty)
+			continue;
+			
+		if((em_cs_stale & _BV(r)) && !em_range_checksum(r)){
+			res = FALSE;
+			continue;
+		}
+		for(i = first; i <= last; i++){
+			if(!em_bit_test(em_shadow_valid, i))
+				break;
+		}
+		if(i <= last){
+			res = FALSE;
+			continue;
+		}
+		
+		// Unlock, write the range and the checksum, lock
+		res &= em_write_verified(start, 0x5678);
+		for(i = first; i <= last; i++){
+			res &= em_write_verified(i, em_shadow[i]);
+			em_bit_set(em_shadow_dirty, i, FALSE);
+		}
+		res &= em_write_verified(cs_addr, em_shadow[cs_addr]);
+		em_bit_set(em_shadow_dirty, cs_addr, FALSE);
+		res &= em_write_verified(start, 0x8765);
+	}
+	return res;
+}
+
+/*
+ * Asynchronous transaction engine
+ * 
+ * Batches of register operations are queued and executed in interrupt
+ * context so the foreground never waits on the chip. The first batch 
+ * in the queue is the active one. When a batch completes its state is
+ * set to EM_BATCH_DONE and the callback (if any) is called.
+ * 
+ * A batch either has a list of operations, or a register list in program
+ * memory whose values are read into an array (see em_read_snapshot()).
+ */
+ 
+static em_batch_t * volatile em_queue = NULL;	// Batch queue head (active batch)
+static volatile uint8_t em_op_index;			// Operation index in the active batch
+static volatile bool em_running;				// TRUE when a batch is in progress
+static volatile uint8_t em_op_addr;				// Address byte of the current operation
+static volatile uint16_t em_op_data;			// Data of the current operation
+
+/*
+ * Load the address and data for the current operation.
+ * 
+ * Called in interrupt context.
+ */
+ 
+static void em_op_load(void)
+{
+	em_batch_t *batch = em_queue;
+	uint8_t i = em_op_index;
 	
+	if(batch->ops){
+		em_op_addr = batch->ops[i].addr;
+		em_op_data = batch->ops[i].data;
+	}
+	else{
+		em_op_addr = pgm_read_byte(&batch->reglist[i]) | EM_READ;
+		em_op_data = 0;
+	}
+}
+
+/*
+ * Skip snapshot entries which are not in the mask, starting at
+ * the current operation.
+ * 
+ * Called in interrupt context.
+ */
+ 
+static void em_op_skip(void)
+{
+	em_batch_t *batch = em_queue;
+	uint8_t i = em_op_index;
+	
+	if(!batch->ops){
+		while((i < batch->count) && !(batch->mask & _BV(i)))
+			i++;
+	}
+	em_op_index = i;
+}
+
+/*
+ * Store the result of the current operation and advance to the next one.
+ * 
+ * Returns TRUE if there are more operations in the batch.
+ * Called in interrupt context.
+ */
+ 
+static bool em_op_store(void)
+{
+	em_batch_t *batch = em_queue;
+	uint8_t i = em_op_index;
 	
+	if(em_op_addr & EM_READ){
+		if(batch->ops)
+			batch->ops[i].data = em_op_data;
+		else
+			batch->values[i] = em_op_data;
+	}
+	em_op_index = ++i;
+	em_op_skip();
+	return (em_op_index < batch->count);
+}
+
+/*
+ * Mark the start of a batch. All values in the batch carry this timestamp.
+ * 
+ * Called in interrupt context.
+ */
+ 
+static void em_batch_begin(void)
+{
+	em_running = TRUE;
+	em_op_index = 0;
+	em_op_skip();
+	em_queue->ticks = timer0_ticks64;
+	em_op_load();
+}
+
+/*
+ * Remove the completed batch from the queue and notify the owner.
+ * 
+ * Called in interrupt context.
+ */
+ 
+static void em_batch_complete(void)
+{
+	em_batch_t *batch = em_queue;
+	
+	em_running = FALSE;
+	em_queue = batch->next;
+	batch->state = EM_BATCH_DONE;
+	if(batch->callback)
+		batch->callback(batch);
+}
+
+#if !defined(__AVR__)
+
+/*
+ * Host engine
+ * 
+ * The simulated chip has no bus timing, so the timer tick runs all of
+ * the queued batches to completion.
+ */
+ 
+void em_service(void)
+{
+	while(em_queue && !em_paused){
+		em_batch_begin();
+		for(;;){
+			if(em_op_addr & EM_READ)
+				em_op_data = em_read_transaction(em_op_addr & ~EM_READ);
+			else
+				em_write_transaction(em_op_addr, em_op_data);
+			if(FALSE == em_op_store())
+				break;
+			em_op_load();
+		}
+		em_batch_complete();
+	}
+}
+
+/*
+ * Start the engine if it is idle. Called with interrupts disabled.
+ * 
+ * Nothing to do here, the next tick runs the batch.
+ */
+ 
+static void em_kick(void)
+{
+}
+
+#elif defined(EM_SPI_SOFT)
+
+/*
+ * Software SPI engine
+ * 
+ * Advanced from the timer tick. Each operation takes two ticks: 
+ * one to hold SCLK low for the start condition and one to clock the
+ * 24 bits. The bits are clocked in interrupt context.
+ */
+ 
+void em_service(void)
+{
+	if(!em_queue)
+		return;
+		
+	if(!em_running){
+		// Start condition for the first operation
+		if(em_paused || (FALSE == em_try_lock()))
+			return; // Foreground has the bus, try again next tick
+		em_batch_begin();
+		SCLK_LOW;
+		return;
+	}
+	
+	// Start condition has been held for at least one tick, do the transfer
+	em_transact_byte(em_op_addr);
+	if(em_op_addr & EM_READ){
+		em_op_data = em_transact_byte(0) << 8;
+		em_op_data |= em_transact_byte(0);
+	}
+	else{
+		em_transact_byte((uint8_t) (em_op_data >> 8));
+		em_transact_byte((uint8_t) em_op_data);
+	}
+	
+	if(em_op_store()){
+		// Start condition for the next operation
+		em_op_load();
+		SCLK_LOW;
+		return;
+	}
+	
+	em_locked = FALSE;
+	em_batch_complete();
+}
+
+/*
+ * Start the engine if it is idle. Called with interrupts disabled.
+ * 
+ * Nothing to do here, the next tick starts the batch.
+ */
+ 
+static void em_kick(void)
+{
+}
+
+#else
+
+/*
+ * Hardware SPI engine
+ * 
+ * Each byte transfer complete interrupt sends the next byte. The engine
+ * owns the bus for the whole batch, so the bus is only arbitrated and
+ * configured once per batch.
+ */
+
+static volatile uint8_t em_byte_index;			// Byte index in the current operation
+
+/*
+ * Start the current operation. Called in interrupt context.
+ */
+ 
+static void em_op_start(void)
+{
+	em_byte_index = 0;
+	spi_select(&em_spi, TRUE);
+	SPDR = em_op_addr;
+}
+
+/*
+ * Start the engine if it is idle and there is work to do. 
+ * Called with interrupts disabled.
+ */
+ 
+static void em_kick(void)
+{
+	if(em_running || em_paused || !em_queue)
+		return;
+	if(FALSE == spi_try_acquire(&em_spi))
+		return; // Bus busy, the timer tick will retry
+	em_batch_begin();
+	SPCR |= _BV(SPIE);
+	em_op_start();
+}
+
+/*
+ * Timer tick service. Restarts the engine if it was waiting for the bus.
+ */
+
+void em_service(void)
+{
+	em_kick();
+}
+
+/*
+ * SPI transfer complete interrupt
+ */
+ 
+ISR(SPI_STC_vect)
+{
+	uint8_t in_byte = SPDR;
+	
+	switch(++em_byte_index){
+		case 1: // Address sent
+			SPDR = (em_op_addr & EM_READ) ? 0 : (uint8_t) (em_op_data >> 8);
+			break;
+			
+		case 2: // High byte done
+			if(em_op_addr & EM_READ){
+				em_op_data = ((uint16_t) in_byte) << 8;
+				SPDR = 0;
+			}
+			else
+				SPDR = (uint8_t) em_op_data;
+			break;
+			
+		default: // Low byte done
+			if(em_op_addr & EM_READ)
+				em_op_data |= in_byte;
+			spi_select(&em_spi, FALSE);
+			if(em_op_store()){
+				em_op_load();
+				em_op_start();
+				break;
+			}
+			// Batch complete, give up the bus
+			SPCR &= ~_BV(SPIE);
+			spi_release(&em_spi);
+			em_batch_complete();
+			// Start the next batch if there is one
+			em_kick();
+			break;
+	}
+}
+
+#endif
+
+/*
+ * Queue a batch of operations.
+ * 
+ * Returns FALSE if the batch is empty or already queued.
+ */
+ 
+bool em_batch_submit(em_batch_t *batch)
+{
+	em_batch_t *b;
+	
+	if(!batch || !batch->count || (EM_BATCH_QUEUED == batch->state))
+		return FALSE;
+		
+	batch->state = EM_BATCH_QUEUED;
+	batch->next = NULL;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		// Insert at the end of the queue
+		if(!em_queue)
+			em_queue = batch;
+		else{
+			for(b = em_queue; b->next; b = b->next)
+				;
+			b->next = batch;
+		}
+		em_kick();
+	}
+	return TRUE;
+}
+
+/*
+ * Start a snapshot read.
+ * 
+ * Reads the registers in reglist (program memory) into values, in list 
+ * order, as one batch. Only entries with their bit set in mask are read,
+ * the others are left alone. The batch timestamp applies to all of the
+ * values read. Poll batch->state for EM_BATCH_DONE, or use a callback.
+ * 
+ * Returns FALSE if the batch is already queued, there is nothing to read,
+ * or mask has bits at or above count.
+ */
+ 
+bool em_read_snapshot(em_batch_t *batch, const uint8_t *reglist, uint8_t count, uint16_t *values, uint16_t mask)
+{
+	if(!batch || !mask || (count > EM_SNAPSHOT_MAX) || (EM_BATCH_QUEUED == batch->state))
+		return FALSE;
+	// Mask bits past the list would read past reglist and values
+	if((count < EM_SNAPSHOT_MAX) && (mask >> count))
+		return FALSE;
+	batch->ops = NULL;
+	batch->reglist = reglist;
+	batch->values = values;
+	batch->count = count;
+	batch->mask = mask;
+	return em_batch_submit(batch);
+}
+
+/*
+ * Select a timing profile
+ */
+ 
+void em_set_timing(uint8_t profile)
+{
+	em_timing_t t;
+	
+	if(profile >= EM_TIMING_COUNT)
+		return;
+	memcpy_P(&t, &em_timings[profile], sizeof(t));
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		em_timing = profile;
+#if defined(__AVR__) && defined(EM_SPI_SOFT)
+		em_clk_loops = t.clk_loops;
+		em_start_loops = t.start_loops;
+#elif defined(__AVR__)
+		// Takes effect the next time the chip acquires the bus
+		em_spi.spcr = EM_SPCR | t.spcr;
+		em_spi.spsr = t.spsr;
+#endif
+	}
+}
+
+/*
+ * Return the selected timing profile
+ */
+ 
+uint8_t em_get_timing(void)
+{
+	return em_timing;
+}
+
+/*
+ * Return the nominal SCLK frequency of a profile in kHz, 0 if the 
+ * profile does not exist.
+ */
+ 
+uint16_t em_timing_khz(uint8_t profile)
+{
+	if(profile >= EM_TIMING_COUNT)
+		return 0;
+	return pgm_read_word(&em_timings[profile].khz);
+}
+
+/*
+ * Check the selected timing profile.
+ * 
+ * Reads registers with known contents several times. Each read is 
+ * followed by a read of LASTSPIDATA, which must echo the same value.
+ * 
+ * Returns TRUE if every read matched.
+ */
+ 
+bool em_check_timing(uint8_t count, const uint8_t *addrs, const uint16_t *expected)
+{
+	uint8_t pass, i;
+	
+	for(pass = 0; pass < EM_TUNE_PASSES; pass++){
+		for(i = 0; i < count; i++){
+			if(em_read_transaction(addrs[i]) != expected[i])
+				return FALSE;
+			if(em_read_transaction(EM_LASTSPIDATA) != expected[i])
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Find the fastest reliable timing profile.
+ * 
+ * Steps through the profiles from slowest to fastest, checking each one
+ * with em_check_timing(). Stops at the first failure. The fastest profile
+ * which passed is selected and returned. Profile 0 is selected if none pass.
+ * 
+ * Must be called with the transaction engine idle.
+ */
+ 
+uint8_t em_tune_timing(uint8_t count, const uint8_t *addrs, const uint16_t *expected)
+{
+	uint8_t profile, best = 0;
+	
+	for(profile = 0; profile < EM_TIMING_COUNT; profile++){
+		em_set_timing(profile);
+		if(FALSE == em_check_timing(count, addrs, expected))
+			break;
+		best = profile;
+	}
+	em_set_timing(best);
+	return best;
+}
 
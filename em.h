@@ -76,11 +76,60 @@
 #define EM_PANGLE2 0x6E
 #define EM_SMEAN2 0x6F
 
+// Register bits
+
+#define EM_SYSSTATUS_SAGWARN 0x0002				// Voltage sag
+#define EM_FUNCEN_SAGEN 0x0020					// Sag detection enable
+
 #define EM_CAL_FIRST EM_PLCONSTH
 #define EM_CAL_LAST EM_MMODE
 #define EM_MEAS_FIRST EM_UGAIN
 #define EM_MEAS_LAST EM_QOFFSETN
 
+// Read bit in the address byte
+#define EM_READ 0x80
+
+// Maximum number of registers in a snapshot
+#define EM_SNAPSHOT_MAX 16
+
+/*
+ * Asynchronous transaction engine data structures
+ */
+
+// Batch states
+enum {EM_BATCH_IDLE = 0, EM_BATCH_QUEUED, EM_BATCH_DONE};
+
+// A single register operation
+typedef struct {
+	uint8_t addr;								// Register address, EM_READ set for a read
+	uint16_t data;								// Data to write, or data read back
+} em_op_t;
+
+// Verified transaction counters
+typedef struct {
+	uint32_t verified;							// Transactions which verified
+	uint16_t retries;							// Retries after a mismatch
+	uint16_t failures;							// Transactions which failed every retry
+} em_diag_t;
+
+typedef struct em_batch_s em_batch_t;
+
+// Completion callback, called in interrupt context
+typedef void (*em_batch_callback_t)(em_batch_t *batch);
+
+// A list of register operations done as one unit
+struct em_batch_s {
+	em_op_t *ops;								// Operation list, or NULL for a snapshot
+	const uint8_t *reglist;						// Snapshot register list (program memory)
+	uint16_t *values;							// Snapshot values, in register list order
+	uint16_t mask;								// Snapshot entries to read, bit per entry
+	uint8_t count;								// Number of operations
+	volatile uint8_t state;						// Batch state
+	uint64_t ticks;								// timer0 tick count when the batch started
+	em_batch_callback_t callback;				// Completion callback or NULL
+	struct em_batch_s *next;					// Next batch in the queue
+};
+
  
 /*
  * Function prototypes
@@ -92,9 +141,37 @@ void em_init(void);
 void em_write_transaction(uint8_t addr, uint16_t data);
 // Do a 24 bit read transaction
 uint16_t em_read_transaction(uint8_t addr);
+// Do a write transaction and verify it with LASTSPIDATA
+bool em_write_verified(uint8_t addr, uint16_t data);
+// Do a read transaction and verify it with LASTSPIDATA
+bool em_read_verified(uint8_t addr, uint16_t *data);
+// Return the verified transaction counters
+const em_diag_t *em_get_diag(void);
 // Write a block of data
 uint16_t em_write_block(uint8_t first, uint8_t last, uint16_t *block);
 // Read a block of data
 uint16_t em_read_block(uint8_t first, uint8_t last, uint16_t *block);
-
-
+// Read a register, from the shadow if its value is known
+uint16_t em_reg_read(uint8_t addr);
+// Write a register to the shadow (or to the chip if not shadowed)
+void em_reg_write(uint8_t addr, uint16_t value);
+// Write a block of registers to the shadow
+void em_reg_write_block(uint8_t first, uint8_t last, const uint16_t *block);
+// Write dirty shadow registers to the chip
+bool em_reg_flush(void);
+// Queue a batch of operations
+bool em_batch_submit(em_batch_t *batch);
+// Advance the transaction engine (call from the timer tick interrupt)
+void em_service(void);
+// Read a register list into a packed structure of 16 bit values
+bool em_read_snapshot(em_batch_t *batch, const uint8_t *reglist, uint8_t count, uint16_t *values, uint16_t mask);
+// Select an SPI timing profile
+void em_set_timing(uint8_t profile);
+// Return the selected SPI timing profile
+uint8_t em_get_timing(void);
+// Return the nominal SCLK frequency of a timing profile in kHz
+uint16_t em_timing_khz(uint8_t profile);
+// Check the selected timing profile against registers with known contents
+bool em_check_timing(uint8_t count, const uint8_t *addrs, const uint16_t *expected);
+// Find and select the fastest reliable timing profile
+uint8_t em_tune_timing(uint8_t count, const uint8_t *addrs, const uint16_t *expected);
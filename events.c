@@ -0,0 +1,215 @@
+//
+//		events.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Power quality event recorder
+ *
+ * Records voltage sags and swells and over current. A sag starts when 
+ * the chip's sag warning is set or Vrms falls below the sag threshold. 
+ * The chip has no swell or over current detection, so those compare 
+ * the fast polled Vrms and Irms against their thresholds (see config.h). 
+ * An event ends when its condition has cleared by the hysteresis.
+ *
+ * Finished events go into a RAM ring of EVENTS_MAX, newest first. With 
+ * EVENTS_EEPROM defined, they are also written to an EEPROM log, so the
+ * most recent ones survive a reset.
+ */
+
+#include "includes.h"
+
+// Thresholds in register units (0.01V and 0.001A)
+#define EVENT_SAG_TH ((uint16_t) (EVENT_NOMINAL_V * EVENT_SAG_PCT))
+#define EVENT_SWELL_TH ((uint16_t) (EVENT_NOMINAL_V * EVENT_SWELL_PCT))
+#define EVENT_HYST ((uint16_t) (EVENT_NOMINAL_V * EVENT_HYST_PCT))
+#define EVENT_OC_TH ((uint16_t) (EVENT_OVERCURRENT_A * 1000UL))
+#define EVENT_OC_HYST ((uint16_t) (EVENT_OVERCURRENT_A * 10UL * EVENT_HYST_PCT))
+
+// Event in progress
+typedef struct {
+	event_t ev;									// Event so far
+	uint64_t start_ticks;						// timer0 tick count at the start
+	bool active;								// TRUE while the event lasts
+} event_track_t;
+
+static event_t events_ring[EVENTS_MAX];
+static uint8_t events_head;						// Next ring entry to write
+static uint8_t events_count;					// Number of ring entries used
+static event_track_t events_track[EVENT_TYPES];
+
+#ifdef EVENTS_EEPROM
+static uint8_t EEMEM events_eemem[EVENTS_EE_SIZE];
+static eelog_t events_log;
+#endif
+
+/*
+ * Find the saved events
+ */
+ 
+void events_init(void)
+{
+#ifdef EVENTS_EEPROM
+	eelog_init(&events_log, events_eemem, sizeof(events_eemem), sizeof(event_t));
+#endif
+}
+
+/*
+ * Return the SAGTH register value for the sag threshold
+ * 
+ * SAGTH = Vth * 100 * sqrt(2) / (2 * Ugain / 32768)
+ */
+ 
+uint16_t events_sagth(uint16_t ugain)
+{
+	if(!ugain)
+		return 0;
+	// 100 * sqrt(2) * 16384 = 2317047
+	return (uint16_t) (((EVENT_SAG_TH / 100UL) * 2317047UL) / ugain);
+}
+
+/*
+ * Convert a tick count difference to milliseconds
+ */
+ 
+static uint32_t events_ms(uint64_t ticks)
+{
+	// A tick is 1.024ms
+	return (uint32_t) ((ticks * 128) / 125);
+}
+
+/*
+ * Track one event type
+ * 
+ * on starts the event, off ends it. value updates the extreme.
+ */
+ 
+static void events_update(uint8_t type, bool on, bool off, uint16_t value, uint64_t ticks)
+{
+	event_track_t *t = &events_track[type];
+	
+	if(!t->active){
+		if(!on)
+			return;
+		// Start
+		t->active = TRUE;
+		t->start_ticks = ticks;
+		t->ev.type = type;
+		if(tou_get_clock(&t->ev.start))
+			t->ev.type |= EVENT_SYNCED;
+		t->ev.extreme = value;
+		return;
+	}
+	
+	if(EVENT_SAG == type){
+		if(value < t->ev.extreme)
+			t->ev.extreme = value;
+	}
+	else if(value > t->ev.extreme)
+		t->ev.extreme = value;
+		
+	if(!off)
+		return;
+		
+	// End, save in the ring
+	t->active = FALSE;
+	t->ev.duration = events_ms(ticks - t->start_ticks);
+	events_ring[events_head] = t->ev;
+	if(++events_head >= EVENTS_MAX)
+		events_head = 0;
+	if(events_count < EVENTS_MAX)
+		events_count++;
+#ifdef EVENTS_EEPROM
+	eelog_write(&events_log, &t->ev);
+#endif
+}
+
+/*
+ * Check a voltage reading for sags and swells
+ */
+ 
+void events_voltage(uint16_t urms, bool sagwarn, uint64_t ticks)
+{
+	events_update(EVENT_SAG, sagwarn || (urms < EVENT_SAG_TH),
+		!sagwarn && (urms >= EVENT_SAG_TH + EVENT_HYST), urms, ticks);
+	events_update(EVENT_SWELL, (urms > EVENT_SWELL_TH),
+		(urms <= EVENT_SWELL_TH - EVENT_HYST), urms, ticks);
+}
+
+/*
+ * Check a current reading for over current
+ */
+ 
+void events_current(uint16_t irms, uint64_t ticks)
+{
+	events_update(EVENT_OVERCURRENT, (irms > EVENT_OC_TH),
+		(irms <= EVENT_OC_TH - EVENT_OC_HYST), irms, ticks);
+}
+
+/*
+ * Get a finished event from the RAM ring, age 0 is the newest
+ * 
+ * Returns FALSE if there is no such event
+ */
+ 
+bool events_get(uint8_t age, event_t *ev)
+{
+	if(age >= events_count)
+		return FALSE;
+	*ev = events_ring[(events_head + EVENTS_MAX - 1 - age) % EVENTS_MAX];
+	return TRUE;
+}
+
+/*
+ * Get an event in progress, with its duration so far
+ * 
+ * Returns FALSE if there is none of that type
+ */
+ 
+bool events_active(uint8_t type, event_t *ev, uint64_t ticks)
+{
+	event_track_t *t;
+	
+	if(type >= EVENT_TYPES)
+		return FALSE;
+	t = &events_track[type];
+	if(!t->active)
+		return FALSE;
+	*ev = t->ev;
+	ev->duration = events_ms(ticks - t->start_ticks);
+	return TRUE;
+}
+
+/*
+ * Get a finished event from the EEPROM log, age 0 is the newest
+ * 
+ * Returns FALSE if there is no such event
+ */
+ 
+bool events_get_saved(uint8_t age, event_t *ev)
+{
+#ifdef EVENTS_EEPROM
+	return eelog_read_back(&events_log, age, ev);
+#else
+	(void) age;
+	(void) ev;
+	return FALSE;
+#endif
+}
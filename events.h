@@ -0,0 +1,31 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// Event types
+
+enum {EVENT_SAG = 0, EVENT_SWELL, EVENT_OVERCURRENT, EVENT_TYPES};
+
+// Set in the type when the start time is clock time, not uptime
+
+#define EVENT_SYNCED 0x80
+
+// A power quality event
+
+typedef struct {
+	uint32_t start;								// Start time (seconds)
+	uint32_t duration;							// Duration (ms)
+	uint16_t extreme;							// Lowest voltage of a sag, highest voltage or current otherwise
+	uint8_t type;								// Event type, and EVENT_SYNCED
+} event_t;
+
+// Methods
+
+void events_init(void);
+uint16_t events_sagth(uint16_t ugain);
+void events_voltage(uint16_t urms, bool sagwarn, uint64_t ticks);
+void events_current(uint16_t irms, uint64_t ticks);
+bool events_get(uint8_t age, event_t *ev);
+bool events_active(uint8_t type, event_t *ev, uint64_t ticks);
+bool events_get_saved(uint8_t age, event_t *ev);
+
+#endif
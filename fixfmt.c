@@ -0,0 +1,149 @@
+//
+//		fixfmt.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Fixed point decimal formatting without printf or division
+ *
+ * Digits are extracted by multiplying by the reciprocal of 10: 
+ * 16 bit values with a single 16x16 multiply (0xCCCD / 2^19), 32 bit
+ * values with the shift and add form of the same reciprocal. Both are
+ * exact over their whole input range.
+ */
+
+#include "includes.h"
+
+/*
+ * Divide a 16 bit value by 10, and return the remainder in *rem
+ */
+
+static uint16_t fixfmt_div10_u16(uint16_t n, uint8_t *rem)
+{
+	uint16_t q = (uint16_t) (((uint32_t) n * 0xCCCDUL) >> 19);
+	
+	*rem = (uint8_t) (n - ((q << 3) + (q << 1)));
+	return q;
+}
+
+/*
+ * Divide a 32 bit value by 10, and return the remainder in *rem
+ */
+ 
+static uint32_t fixfmt_div10_u32(uint32_t n, uint8_t *rem)
+{
+	uint32_t q;
+	uint8_t r;
+	
+	// q = n * 0.8, then divide by 8
+	q = (n >> 1) + (n >> 2);
+	q += q >> 4;
+	q += q >> 8;
+	q += q >> 16;
+	q >>= 3;
+	// The estimate can be one low
+	r = (uint8_t) (n - ((q << 3) + (q << 1)));
+	if(r > 9){
+		q++;
+		r -= 10;
+	}
+	*rem = r;
+	return q;
+}
+
+/*
+ * Format a fixed point number.
+ * 
+ * mag is the magnitude in units of 10^-places, negative adds a minus sign.
+ * At least digits integer digits are shown, zero padded. If width is 
+ * not zero, the result is right aligned in a field of width characters.
+ * The result is truncated to fit in len bytes including the terminator.
+ * 
+ * Returns dest.
+ */
+ 
+char *fixfmt(char *dest, uint8_t len, uint32_t mag, bool negative, uint8_t places, 
+uint8_t digits, uint8_t width)
+{
+	char buf[FIXFMT_MAX - 1];
+	char *p = buf + sizeof(buf);
+	char *d = dest;
+	uint8_t n = 0, rem;
+	
+	if(!len)
+		return dest;
+	
+	if(!digits)
+		digits = 1;
+		
+	// Digits, least significant first. 16 bit arithmetic once it fits.
+	// Each digit leaves room for the decimal point after it, if any, and
+	// the sign.
+	while((mag || (n < places + digits)) && (p > buf + 1 + ((n + 1) == places))){
+		if(mag > 0xFFFF)
+			mag = fixfmt_div10_u32(mag, &rem);
+		else
+			mag = fixfmt_div10_u16((uint16_t) mag, &rem);
+		*--p = '0' + rem;
+		if(++n == places)
+			*--p = '.';
+	}
+	if(negative)
+		*--p = '-';
+	n = (uint8_t) (buf + sizeof(buf) - p);
+	
+	// Pad, then copy what fits
+	len--;
+	for(; (width > n) && len; width--, len--)
+		*d++ = ' ';
+	if(n > len)
+		n = len;
+	memcpy(d, p, n);
+	d[n] = 0;
+	return dest;
+}
+
+/*
+ * Format an unsigned 16 bit fixed point number
+ */
+ 
+char *fixfmt_u16(char *dest, uint8_t len, uint8_t places, uint16_t val)
+{
+	return fixfmt(dest, len, val, FALSE, places, 1, 0);
+}
+
+/*
+ * Format a two's complement 16 bit fixed point number
+ */
+ 
+char *fixfmt_s16(char *dest, uint8_t len, uint8_t places, int16_t val)
+{
+	return fixfmt(dest, len, (val < 0) ? -(int32_t) val : val, (val < 0), places, 1, 0);
+}
+
+/*
+ * Format a sign and magnitude 16 bit fixed point number
+ */
+ 
+char *fixfmt_sm16(char *dest, uint8_t len, uint8_t places, uint16_t val)
+{
+	// Negative zero formats as zero
+	return fixfmt(dest, len, val & 0x7FFF, ((val & 0x8000) && (val & 0x7FFF)), places, 1, 0);
+}
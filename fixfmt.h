@@ -0,0 +1,16 @@
+#ifndef FIXFMT_H
+#define FIXFMT_H
+
+// Buffer for the longest formatted number: sign, 10 digits, a decimal 
+// point and the terminator
+#define FIXFMT_MAX 13
+
+// Methods
+
+char *fixfmt(char *dest, uint8_t len, uint32_t mag, bool negative, uint8_t places, 
+	uint8_t digits, uint8_t width);
+char *fixfmt_u16(char *dest, uint8_t len, uint8_t places, uint16_t val);
+char *fixfmt_s16(char *dest, uint8_t len, uint8_t places, int16_t val);
+char *fixfmt_sm16(char *dest, uint8_t len, uint8_t places, uint16_t val);
+
+#endif
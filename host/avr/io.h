@@ -0,0 +1,12 @@
+/*
+ * Host build stand-in for <avr/io.h>
+ *
+ * uart.h checks its buffer sizes against the ATmega328P RAM size.
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#define RAMEND 0x8FF
+
+#endif
@@ -0,0 +1,138 @@
+//
+//		bench_dispatch.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+
+/*
+ * Command dispatch benchmark
+ *
+ * Checks that every command name in the firmware finds its own table 
+ * entry, reports hash slot collisions, then times a lookup against the
+ * strcmp_P chain it replaced. Times are for the host, not the AVR, so 
+ * only the ratio means anything.
+ */
+
+#include <time.h>
+#include "includes.h"
+
+#define BENCH_LOOKUPS 2000000UL
+
+// The firmware's commands
+
+static const char * const names[] = {
+	"query", "resetkwh", "register", "cf", "schedule", "energy", "clock", 
+	"tou", "events", "demand", "stats", "diag", "subscribe", "baud", 
+	"binary", "spitune", "regs"
+};
+
+#define NAMES (sizeof(names) / sizeof(names[0]))
+
+// Names which must not be found
+
+static const char * const unknown[] = {"", "q", "queryx", "Query", "config", "stat"};
+
+static volatile uint8_t called;
+
+static void handler(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	called++;
+}
+
+/*
+ * The strcmp_P chain formerly in process_command(). It had no elses, so
+ * every comparison ran whatever the command.
+ */
+ 
+static int ref_find(const char *command)
+{
+	unsigned i;
+	int found = -1;
+	
+	for(i = 0; i < NAMES; i++){
+		if(!strcmp_P(command, names[i]))
+			found = (int) i;
+	}
+	return found;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	dispatch_cmd_t table[NAMES], cmd;
+	dispatch_t d;
+	uint32_t n, errors = 0, moved = 0;
+	volatile int sink = 0;
+	double start, t_ref, t_new;
+	uint8_t i, len;
+	
+	for(i = 0; i < NAMES; i++){
+		table[i].name = names[i];
+		table[i].len = strlen(names[i]);
+		table[i].fn = handler;
+		table[i].args = NULL;
+	}
+	dispatch_init(&d, table, NAMES);
+	
+	// Every command finds itself, and how many missed their first slot
+	for(i = 0; i < NAMES; i++){
+		len = strlen(names[i]);
+		if(!dispatch_find(&d, names[i], len, &cmd) || (cmd.name != names[i])){
+			printf("%s: not found\n", names[i]);
+			errors++;
+		}
+		if(d.slot[dispatch_hash(names[i], len) >> 3] != (i + 1))
+			moved++;
+	}
+	for(i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++){
+		if(dispatch_find(&d, unknown[i], strlen(unknown[i]), &cmd)){
+			printf("\"%s\": found\n", unknown[i]);
+			errors++;
+		}
+	}
+	printf("commands: %u, slots: %u, collisions: %u, errors: %u\n", 
+		(unsigned) NAMES, DISPATCH_SLOTS, moved, errors);
+	
+	start = now_sec();
+	for(n = 0; n < BENCH_LOOKUPS; n++)
+		sink += ref_find(names[n % NAMES]);
+	t_ref = (now_sec() - start) * 1e9 / BENCH_LOOKUPS;
+	
+	start = now_sec();
+	for(n = 0; n < BENCH_LOOKUPS; n++){
+		i = n % NAMES;
+		if(dispatch_find(&d, names[i], strlen(names[i]), &cmd))
+			sink += cmd.len;
+	}
+	t_new = (now_sec() - start) * 1e9 / BENCH_LOOKUPS;
+	
+	printf("lookup: strcmp_P chain %.1f ns, hash %.1f ns\n", t_ref, t_new);
+	
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+//
+//		bench_fixfmt.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Fixed point formatter benchmark
+ *
+ * Checks that fixfmt.c gives the same strings as the snprintf based 
+ * functions it replaced, over every 16 bit input and a sweep of kWh
+ * values, and against snprintf over a sweep of signed 32 bit values
+ * with 0 to 6 places. Then times both. Times are for the host, not the AVR, so only
+ * the ratio means anything.
+ */
+
+#include <time.h>
+#include "includes.h"
+
+#define BENCH_PASSES 20
+
+// The snprintf based formatters formerly in main.c
+
+static char *ref_u16(char *dest, uint8_t len, uint8_t places, uint16_t val)
+{
+	if(2 == places)
+		snprintf(dest, len, "%d.%02d", val / 100, val % 100);
+	else
+		snprintf(dest, len, "%d.%03d", val / 1000, val % 1000);
+	return dest;
+}
+
+static char *ref_s16(char *dest, uint8_t len, uint8_t places, int16_t val)
+{
+	int16_t rem, quot;
+	const char *format;
+	
+	if(1 == places){
+		rem = val % 10;
+		quot = val / 10;
+		format = "%d.%d";
+	}
+	else if(2 == places){
+		rem = val % 100;
+		quot = val / 100;
+		format = "%d.%02d";
+	}
+	else{
+		rem = val % 1000;
+		quot = val / 1000;
+		format = "%d.%03d";
+	}
+	if(val < 0){
+		quot *= -1;
+		rem *= -1;
+		dest[0] = '-';
+	}
+	snprintf((val < 0) ? dest + 1 : dest, (val < 0) ? len - 1 : len, format, quot, rem);
+	return dest;
+}
+
+static char *ref_sm16(char *dest, uint8_t len, uint8_t places, uint16_t val)
+{
+	int16_t twos_compl = val & 0x7FFF;
+	
+	if(val & 0x8000)
+		twos_compl *= -1;
+	return ref_s16(dest, len, places, twos_compl);
+}
+
+static char *ref_kwh(char *dest, uint8_t len, uint32_t val)
+{
+	// Truncated to len, as fixfmt does
+	if(snprintf(dest, len, "%03u.%04u", (unsigned) (val / 10000), (unsigned) (val % 10000)) < 0)
+		dest[0] = 0;
+	return dest;
+}
+
+static char *new_kwh(char *dest, uint8_t len, uint32_t val)
+{
+	return fixfmt(dest, len, val, FALSE, 4, 3, 0);
+}
+
+// Any 32 bit magnitude with places decimal places
+static char *ref_fixed(char *dest, uint8_t len, uint32_t mag, bool negative, uint8_t places)
+{
+	uint32_t scale = 1;
+	uint8_t i;
+	int n;
+	
+	for(i = 0; i < places; i++)
+		scale *= 10;
+	if(places)
+		n = snprintf(dest, len, "%s%u.%0*u", negative ? "-" : "", (unsigned) (mag / scale), 
+			places, (unsigned) (mag % scale));
+	else
+		n = snprintf(dest, len, "%s%u", negative ? "-" : "", (unsigned) mag);
+	// Truncated to len, as fixfmt does
+	if(n < 0)
+		dest[0] = 0;
+	return dest;
+}
+
+// Next kWh test value: every value to 100000, then geometric steps
+static uint32_t next_kwh(uint32_t v)
+{
+	return (v < 100000) ? v + 1 : v + (v >> 10);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Compare two formatters over every 16 bit value
+ */
+ 
+static uint32_t check16(const char *name, char *(*ref)(char *, uint8_t, uint8_t, uint16_t), 
+char *(*new)(char *, uint8_t, uint8_t, uint16_t), uint8_t places)
+{
+	char a[10], b[10];
+	uint32_t v, errors = 0;
+	
+	for(v = 0; v <= 0xFFFF; v++){
+		ref(a, 8, places, (uint16_t) v);
+		new(b, 8, places, (uint16_t) v);
+		if(strcmp(a, b)){
+			if(errors++ < 5)
+				printf("%s places %u: %04X ref \"%s\" new \"%s\"\n", name, places, v, a, b);
+		}
+	}
+	return errors;
+}
+
+/*
+ * Time a 16 bit formatter over every value
+ */
+ 
+static double time16(char *(*fn)(char *, uint8_t, uint8_t, uint16_t), uint8_t places)
+{
+	char a[10];
+	uint32_t v, pass;
+	volatile char sink = 0;
+	double start = now_sec();
+	
+	for(pass = 0; pass < BENCH_PASSES; pass++){
+		for(v = 0; v <= 0xFFFF; v++){
+			fn(a, 8, places, (uint16_t) v);
+			sink += a[0];
+		}
+	}
+	return (now_sec() - start) * 1e9 / (BENCH_PASSES * 65536.0);
+}
+
+static double time_kwh(char *(*fn)(char *, uint8_t, uint32_t))
+{
+	char a[12];
+	uint32_t v, pass, n = 0;
+	volatile char sink = 0;
+	double start = now_sec();
+	
+	for(pass = 0; pass < BENCH_PASSES; pass++){
+		for(v = 0; v < 655360000UL; v = next_kwh(v), n++){
+			fn(a, 10, v);
+			sink += a[0];
+		}
+	}
+	return (now_sec() - start) * 1e9 / n;
+}
+
+// Adapters so the signed formatter fits the 16 bit table
+
+static char *ref_s16u(char *d, uint8_t l, uint8_t p, uint16_t v)
+{
+	return ref_s16(d, l, p, (int16_t) v);
+}
+
+static char *new_s16u(char *d, uint8_t l, uint8_t p, uint16_t v)
+{
+	return fixfmt_s16(d, l, p, (int16_t) v);
+}
+
+int main(void)
+{
+	char a[FIXFMT_MAX], b[FIXFMT_MAX];
+	uint32_t v, errors = 0;
+	uint8_t places, neg;
+	
+	errors += check16("u16", ref_u16, fixfmt_u16, 2);
+	errors += check16("u16", ref_u16, fixfmt_u16, 3);
+	errors += check16("s16", ref_s16u, new_s16u, 1);
+	errors += check16("s16", ref_s16u, new_s16u, 3);
+	errors += check16("sm16", ref_sm16, fixfmt_sm16, 1);
+	errors += check16("sm16", ref_sm16, fixfmt_sm16, 3);
+	for(v = 0; v < 655360000UL; v = next_kwh(v)){
+		ref_kwh(a, 10, v);
+		new_kwh(b, 10, v);
+		if(strcmp(a, b) && (errors++ < 5))
+			printf("kwh: %u ref \"%s\" new \"%s\"\n", v, a, b);
+	}
+	for(places = 0; places <= 6; places++){
+		for(v = 0; ; v = next_kwh(v)){
+			for(neg = 0; neg < 2; neg++){
+				ref_fixed(a, sizeof(a), v, neg, places);
+				fixfmt(b, sizeof(b), v, neg, places, 1, 0);
+				if(strcmp(a, b) && (errors++ < 5))
+					printf("fixed places %u: %s%u ref \"%s\" new \"%s\"\n", places, neg ? "-" : "", v, a, b);
+			}
+			if(v > (0xFFFFFFFFUL - (v >> 10)))
+				break;
+		}
+		// The largest magnitude
+		ref_fixed(a, sizeof(a), 0xFFFFFFFFUL, TRUE, places);
+		fixfmt(b, sizeof(b), 0xFFFFFFFFUL, TRUE, places, 1, 0);
+		if(strcmp(a, b) && (errors++ < 5))
+			printf("fixed places %u: -4294967295 ref \"%s\" new \"%s\"\n", places, a, b);
+	}
+	printf("mismatches: %u\n", errors);
+	
+	printf("u16 places 2: snprintf %.1f ns, fixfmt %.1f ns\n", time16(ref_u16, 2), time16(fixfmt_u16, 2));
+	printf("s16 places 3: snprintf %.1f ns, fixfmt %.1f ns\n", time16(ref_s16u, 3), time16(new_s16u, 3));
+	printf("sm16 places 1: snprintf %.1f ns, fixfmt %.1f ns\n", time16(ref_sm16, 1), time16(fixfmt_sm16, 1));
+	printf("kwh: snprintf %.1f ns, fixfmt %.1f ns\n", time_kwh(ref_kwh), time_kwh(new_kwh));
+	
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,478 @@
+//
+//		em_sim.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+
+/*
+ * 90E24 register level simulator
+ *
+ * Implements the em.h transaction functions against a simulated
+ * register file, so that em.c and main.c run unchanged on the host.
+ *
+ * Modelled:
+ * 
+ * - Reset values, and soft reset by writing 0x789A to SOFTRESET.
+ * - CALSTART and ADJSTART: the calibration (0x21-0x2B) and measurement
+ *   calibration (0x31-0x3A) registers and their checksums can only be
+ *   written after 0x5678 is written to the start register, which resets
+ *   the range to its power on values. Writing 0x8765 checks CS1 or CS2,
+ *   and sets the CalErr or AdjErr bits in SYSSTATUS if it does not match. Metering stops on a CS1 error and the 
+ *   measurement registers read zero on a CS2 error.
+ * - LASTSPIDATA echoes the data of the last transaction.
+ * - Energy registers accumulate in 0.1 CF pulse units at a meter 
+ *   constant set by PLCONSTH/PLCONSTL, and clear when read.
+ * - Measurement registers follow a scripted profile, scaled by UGAIN 
+ *   and IGAINL.
+ * - The SagWarn bit of SYSSTATUS, when SagEn is set in FUNCEN and the 
+ *   voltage is below the SAGTH threshold.
+ *
+ * Not modelled: offsets, phase compensation, the N channel, start and
+ * no-load thresholds, and the SPI bus itself.
+ *
+ * Profile file format, one point per line, linearly interpolated:
+ *
+ * <seconds> <volts rms> <amps rms> <phase degrees> [<frequency Hz>]
+ *
+ * Lines starting with # are comments. The simulation ends at the time
+ * of the last point.
+ */
+
+#include <math.h>
+#include "includes.h"
+#include "em_sim.h"
+
+#define EM_SIM_REGS 0x70
+#define EM_SIM_POINTS 256
+
+// Start register values
+#define EM_SIM_RESET 0x6886
+#define EM_SIM_UNLOCK 0x5678
+#define EM_SIM_LOCK 0x8765
+
+// Soft reset key
+#define EM_SIM_SOFTRESET 0x789A
+
+// SYSSTATUS checksum error bits
+#define EM_SIM_CALERR 0xC000
+#define EM_SIM_ADJERR 0x3000
+
+// PLconst times meter constant for the board's analog front end:
+// current gain 8, 1mV across the shunt at 1A and 248mV at 240V.
+// With PLconst set as in main.c, this gives 3200 impulses/kWh.
+#define EM_SIM_PLC_MC (838860800.0 * 8 * 1 * 248 / (240 * 1))
+
+// Energy registers, in register order from EM_APENERGY
+enum {EM_SIM_AP = 0, EM_SIM_AN, EM_SIM_AT, EM_SIM_RP, EM_SIM_RN, EM_SIM_RT, EM_SIM_ENERGY};
+
+typedef struct {
+	double t;									// Time (s)
+	double vrms;								// Voltage (V)
+	double irms;								// Current (A)
+	double phase;								// Current phase lag (degrees)
+	double freq;								// Line frequency (Hz)
+} em_sim_point_t;
+
+// Default profile: idle, low load, resistive, inductive, capacitive, export
+static const em_sim_point_t em_sim_default_profile[] = {
+	{0.0, 240.0, 0.0, 0.0, 60.0},
+	{10.0, 240.0, 0.05, 0.0, 60.0},
+	{20.0, 240.0, 5.0, 0.0, 60.0},
+	{40.0, 238.0, 12.0, 30.0, 59.98},
+	{60.0, 242.0, 8.0, -20.0, 60.02},
+	{70.0, 240.0, 8.0, 180.0, 60.0},
+	{80.0, 240.0, 0.0, 0.0, 60.0}
+};
+
+static em_sim_point_t em_sim_profile[EM_SIM_POINTS];
+static uint16_t em_sim_points;
+
+static uint16_t em_sim_reg[EM_SIM_REGS];		// Register file
+static double em_sim_energy[EM_SIM_ENERGY];		// Energy accumulators (0.1 pulse)
+static em_sim_point_t em_sim_now;				// Present conditions
+static double em_sim_time;						// Simulated time (s)
+static double em_sim_kwh;						// Forward active energy delivered (kWh)
+
+// Counters
+static uint32_t em_sim_reads;
+static uint32_t em_sim_writes;
+static uint32_t em_sim_locked_writes;
+static uint32_t em_sim_cs_errors;
+
+/*
+ * 90E24 checksum over a register range: the low byte is the sum of 
+ * all bytes modulo 256, the high byte is the XOR of all bytes.
+ */
+
+static uint16_t em_sim_checksum(uint8_t first, uint8_t last)
+{
+	uint8_t sum = 0, xor = 0;
+	uint8_t addr;
+	
+	for(addr = first; addr <= last; addr++){
+		sum += (uint8_t) (em_sim_reg[addr] >> 8) + (uint8_t) em_sim_reg[addr];
+		xor ^= (uint8_t) (em_sim_reg[addr] >> 8) ^ (uint8_t) em_sim_reg[addr];
+	}
+	return (((uint16_t) xor) << 8) | sum;
+}
+
+// Power on values of the calibration range registers which aren't zero
+static const uint16_t em_sim_range_defaults[][2] = {
+	{EM_PLCONSTH, 0x0015}, {EM_PLCONSTL, 0xD174}, {EM_PSTARTTH, 0x08BD},
+	{EM_QSTARTTH, 0x0AEC}, {EM_MMODE, 0x9422},
+	{EM_UGAIN, 0x6720}, {EM_IGAINL, 0x7A13}, {EM_IGAINN, 0x7530}
+};
+
+/*
+ * Reset the registers of a calibration range to the power on values,
+ * as writing 0x5678 to its start register does
+ */
+
+static void em_sim_reset_range(uint8_t first, uint8_t last)
+{
+	uint8_t i;
+	
+	memset(&em_sim_reg[first], 0, (last - first + 1) * sizeof(em_sim_reg[0]));
+	for(i = 0; i < sizeof(em_sim_range_defaults) / sizeof(em_sim_range_defaults[0]); i++){
+		if((em_sim_range_defaults[i][0] >= first) && (em_sim_range_defaults[i][0] <= last))
+			em_sim_reg[em_sim_range_defaults[i][0]] = em_sim_range_defaults[i][1];
+	}
+}
+
+/*
+ * Reset the register file to the power on values
+ */
+
+static void em_sim_reset(void)
+{
+	memset(em_sim_reg, 0, sizeof(em_sim_reg));
+	memset(em_sim_energy, 0, sizeof(em_sim_energy));
+	
+	em_sim_reg[EM_FUNCEN] = 0x000C;
+	em_sim_reg[EM_SAGTH] = 0x1D6A;
+	em_sim_reg[EM_TCOEFF_ADJ] = 0x8077;
+	
+	em_sim_reg[EM_CALSTART] = EM_SIM_RESET;
+	em_sim_reset_range(EM_CAL_FIRST, EM_CAL_LAST);
+	em_sim_reg[EM_CS1] = em_sim_checksum(EM_CAL_FIRST, EM_CAL_LAST);
+	
+	em_sim_reg[EM_ADJSTART] = EM_SIM_RESET;
+	em_sim_reset_range(EM_MEAS_FIRST, EM_MEAS_LAST);
+	em_sim_reg[EM_CS2] = em_sim_checksum(EM_MEAS_FIRST, EM_MEAS_LAST);
+}
+
+/*
+ * Return TRUE if a start register allows metering
+ */
+ 
+static bool em_sim_running(uint8_t start, uint16_t err)
+{
+	uint16_t mode = em_sim_reg[start];
+	
+	if(EM_SIM_UNLOCK == mode)
+		return TRUE;
+	return (EM_SIM_LOCK == mode) && !(em_sim_reg[EM_SYSSTATUS] & err);
+}
+
+/*
+ * Write to a start register. Unlocking resets the range, locking checks
+ * the range checksum.
+ */
+
+static void em_sim_start_write(uint8_t start, uint16_t data, uint8_t first, uint8_t last, 
+uint8_t cs, uint16_t err)
+{
+	em_sim_reg[start] = data;
+	if(EM_SIM_UNLOCK == data)
+		em_sim_reset_range(first, last);
+	if(EM_SIM_LOCK != data)
+		return;
+	if(em_sim_checksum(first, last) == em_sim_reg[cs])
+		em_sim_reg[EM_SYSSTATUS] &= ~err;
+	else{
+		em_sim_reg[EM_SYSSTATUS] |= err;
+		em_sim_cs_errors++;
+	}
+}
+
+/*
+ * Sign magnitude encoding used by POWERF and PANGLE
+ */
+ 
+static uint16_t em_sim_sign_mag(double value)
+{
+	uint16_t mag = (uint16_t) fmin(fabs(value) + 0.5, 0x7FFF);
+	
+	return (value < 0) ? (mag | 0x8000) : mag;
+}
+
+/*
+ * Two's complement encoding used by PMEAN, QMEAN and SMEAN
+ */
+ 
+static uint16_t em_sim_twos_compl(double value)
+{
+	return (uint16_t) (int16_t) fmax(fmin(lround(value), 32767), -32768);
+}
+
+/*
+ * Return the value of a measurement register
+ */
+
+static uint16_t em_sim_measure(uint8_t addr)
+{
+	double ugain = em_sim_reg[EM_UGAIN] / (double) 0x6720;
+	double igain = em_sim_reg[EM_IGAINL] / (double) 0x7A13;
+	double v = em_sim_now.vrms * ugain;
+	double i = em_sim_now.irms * igain;
+	double rad = em_sim_now.phase * M_PI / 180.0;
+	double s = v * i;
+	
+	if(!em_sim_running(EM_ADJSTART, EM_SIM_ADJERR))
+		return 0;
+		
+	switch(addr){
+		case EM_IRMS:
+			return (uint16_t) fmin(lround(i * 1000.0), 0xFFFF);
+		case EM_URMS:
+			return (uint16_t) fmin(lround(v * 100.0), 0xFFFF);
+		case EM_PMEAN:
+			return em_sim_twos_compl(s * cos(rad));
+		case EM_QMEAN:
+			return em_sim_twos_compl(s * sin(rad));
+		case EM_SMEAN:
+			return em_sim_twos_compl(s);
+		case EM_FREQ:
+			return (uint16_t) lround(em_sim_now.freq * 100.0);
+		case EM_POWERF:
+			return (s > 0) ? em_sim_sign_mag(cos(rad) * 1000.0) : 0;
+		case EM_PANGLE:
+			return (s > 0) ? em_sim_sign_mag(em_sim_now.phase * 10.0) : 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Return TRUE if the sag warning is on
+ */
+ 
+static bool em_sim_sag(void)
+{
+	double ugain = em_sim_reg[EM_UGAIN] / 32768.0;
+	double v = em_sim_now.vrms * em_sim_reg[EM_UGAIN] / (double) 0x6720;
+	
+	if(!(em_sim_reg[EM_FUNCEN] & EM_FUNCEN_SAGEN) || !em_sim_running(EM_ADJSTART, EM_SIM_ADJERR))
+		return FALSE;
+	// SAGTH = Vth * 100 * sqrt(2) / (2 * Ugain / 32768)
+	return (v < em_sim_reg[EM_SAGTH] * 2.0 * ugain / (100.0 * M_SQRT2));
+}
+
+/*
+ * Read and clear an energy register
+ */
+ 
+static uint16_t em_sim_energy_read(uint8_t index)
+{
+	double units = floor(fmin(em_sim_energy[index], 0xFFFF));
+	
+	em_sim_energy[index] -= units;
+	return (uint16_t) units;
+}
+
+/*
+ * Initialize the simulated chip
+ */
+ 
+void em_init(void)
+{
+	em_sim_reset();
+	if(!em_sim_points){
+		memcpy(em_sim_profile, em_sim_default_profile, sizeof(em_sim_default_profile));
+		em_sim_points = sizeof(em_sim_default_profile) / sizeof(em_sim_point_t);
+	}
+	em_sim_now = em_sim_profile[0];
+}
+
+/*
+ * Do a write transaction
+ */
+
+void em_write_transaction(uint8_t addr, uint16_t data)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		em_sim_writes++;
+		em_sim_reg[EM_LASTSPIDATA] = data;
+		addr &= ~EM_READ;
+		
+		if((EM_SOFTRESET == addr) && (EM_SIM_SOFTRESET == data))
+			em_sim_reset();
+		else if(EM_CALSTART == addr)
+			em_sim_start_write(EM_CALSTART, data, EM_CAL_FIRST, EM_CAL_LAST, EM_CS1, EM_SIM_CALERR);
+		else if(EM_ADJSTART == addr)
+			em_sim_start_write(EM_ADJSTART, data, EM_MEAS_FIRST, EM_MEAS_LAST, EM_CS2, EM_SIM_ADJERR);
+		else if((addr >= EM_CAL_FIRST) && (addr <= EM_CS1)){
+			if(EM_SIM_UNLOCK == em_sim_reg[EM_CALSTART])
+				em_sim_reg[addr] = data;
+			else
+				em_sim_locked_writes++;
+		}
+		else if((addr >= EM_MEAS_FIRST) && (addr <= EM_CS2)){
+			if(EM_SIM_UNLOCK == em_sim_reg[EM_ADJSTART])
+				em_sim_reg[addr] = data;
+			else
+				em_sim_locked_writes++;
+		}
+		else if((EM_FUNCEN == addr) || (EM_SAGTH == addr) || (EM_SMALLPMOD == addr) || 
+		(EM_TCOEFF_ADJ == addr))
+			em_sim_reg[addr] = data;
+		// Anything else is read only
+	}
+}
+
+/*
+ * Do a read transaction
+ */
+
+uint16_t em_read_transaction(uint8_t addr)
+{
+	uint16_t res;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		em_sim_reads++;
+		addr &= ~EM_READ;
+		
+		if(addr >= EM_SIM_REGS)
+			res = 0;
+		else if((addr >= EM_APENERGY) && (addr <= EM_RTENERGY))
+			res = em_sim_energy_read(addr - EM_APENERGY);
+		else if((addr >= EM_IRMS) && (addr <= EM_SMEAN))
+			res = em_sim_measure(addr);
+		else if(EM_SYSSTATUS == addr)
+			res = em_sim_reg[addr] | (em_sim_sag() ? EM_SYSSTATUS_SAGWARN : 0);
+		else
+			res = em_sim_reg[addr];
+		
+		if(EM_LASTSPIDATA != addr)
+			em_sim_reg[EM_LASTSPIDATA] = res;
+	}
+	return res;
+}
+
+/*
+ * Load a profile from a file
+ * 
+ * Returns FALSE if the file can't be read or has no points
+ */
+ 
+bool em_sim_load_profile(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	em_sim_point_t p;
+	int n;
+	
+	if(!f)
+		return FALSE;
+	em_sim_points = 0;
+	while(fgets(line, sizeof(line), f) && (em_sim_points < EM_SIM_POINTS)){
+		if('#' == line[0])
+			continue;
+		p.freq = 60.0;
+		n = sscanf(line, "%lf %lf %lf %lf %lf", &p.t, &p.vrms, &p.irms, &p.phase, &p.freq);
+		if(n < 4)
+			continue;
+		em_sim_profile[em_sim_points++] = p;
+	}
+	fclose(f);
+	if(em_sim_points)
+		em_sim_now = em_sim_profile[0];
+	return (em_sim_points > 0);
+}
+
+/*
+ * Advance simulated time.
+ * 
+ * Interpolates the profile and accumulates energy. Called with
+ * interrupts disabled.
+ * 
+ * Returns FALSE once the end of the profile has been reached.
+ */
+ 
+bool em_sim_tick(uint32_t usec)
+{
+	const em_sim_point_t *a, *b;
+	double f, dt = usec / 1e6;
+	double pulses_per_wh, p, q;
+	uint16_t i;
+	uint32_t plconst;
+	
+	em_sim_time += dt;
+	
+	// Find the segment and interpolate
+	for(i = 1; (i < em_sim_points) && (em_sim_profile[i].t < em_sim_time); i++)
+		;
+	if(i >= em_sim_points){
+		em_sim_now = em_sim_profile[em_sim_points - 1];
+		return FALSE;
+	}
+	a = &em_sim_profile[i - 1];
+	b = &em_sim_profile[i];
+	f = (b->t > a->t) ? (em_sim_time - a->t) / (b->t - a->t) : 1.0;
+	f = fmax(0.0, fmin(f, 1.0));
+	em_sim_now.t = em_sim_time;
+	em_sim_now.vrms = a->vrms + (b->vrms - a->vrms) * f;
+	em_sim_now.irms = a->irms + (b->irms - a->irms) * f;
+	em_sim_now.phase = a->phase + (b->phase - a->phase) * f;
+	em_sim_now.freq = a->freq + (b->freq - a->freq) * f;
+	
+	if(!em_sim_running(EM_CALSTART, EM_SIM_CALERR))
+		return TRUE;
+	
+	// Energy in 0.1 CF pulse units
+	p = em_sim_now.vrms * em_sim_now.irms * cos(em_sim_now.phase * M_PI / 180.0);
+	q = em_sim_now.vrms * em_sim_now.irms * sin(em_sim_now.phase * M_PI / 180.0);
+	plconst = (((uint32_t) em_sim_reg[EM_PLCONSTH]) << 16) | em_sim_reg[EM_PLCONSTL];
+	if(!plconst)
+		return TRUE;
+	pulses_per_wh = EM_SIM_PLC_MC / plconst / 1000.0;
+	p *= dt / 3600.0 * pulses_per_wh * 10.0;
+	q *= dt / 3600.0 * pulses_per_wh * 10.0;
+	
+	em_sim_energy[(p >= 0) ? EM_SIM_AP : EM_SIM_AN] += fabs(p);
+	em_sim_energy[EM_SIM_AT] += fabs(p);
+	em_sim_energy[(q >= 0) ? EM_SIM_RP : EM_SIM_RN] += fabs(q);
+	em_sim_energy[EM_SIM_RT] += fabs(q);
+	if(p > 0)
+		em_sim_kwh += p / (pulses_per_wh * 10.0) / 1000.0;
+	
+	return TRUE;
+}
+
+/*
+ * Print the simulator counters
+ */
+ 
+void em_sim_report(FILE *f)
+{
+	fprintf(f, "{\"simtime\":\"%.3f\",\"reads\":\"%u\",\"writes\":\"%u\",\"lockedwrites\":\"%u\","
+		"\"cserrors\":\"%u\",\"kwh\":\"%.4f\"}\n", em_sim_time, em_sim_reads, em_sim_writes,
+		em_sim_locked_writes, em_sim_cs_errors, em_sim_kwh);
+}
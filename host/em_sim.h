@@ -0,0 +1,33 @@
+//
+//		em_sim.h
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+#ifndef EM_SIM_H
+#define EM_SIM_H
+
+// Load a voltage, current and phase profile
+bool em_sim_load_profile(const char *path);
+// Advance simulated time, returns FALSE when the profile has ended
+bool em_sim_tick(uint32_t usec);
+// Print the simulator counters
+void em_sim_report(FILE *f);
+
+#endif
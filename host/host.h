@@ -0,0 +1,120 @@
+//
+//		host.h
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * avr-libc replacements for the host build.
+ *
+ * Program memory is ordinary memory, and EEPROM variables live in RAM.
+ * Interrupts are emulated by a single lock: cli() takes it, sei() gives
+ * it up, and the simulated timer interrupt runs with it held.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+// Bits
+
+#define _BV(bit) (1U << (bit))
+
+// Program memory
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define pgm_read_dword(addr) (*(const uint32_t *) (addr))
+#define pgm_read_ptr(addr) (*(const void * const *) (addr))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strcpy_P strcpy
+#define strcat_P strcat
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define strncpy_P strncpy
+#define printf_P printf
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+
+// EEPROM
+
+#define EEMEM
+#define eeprom_read_block(dst, src, n) memcpy((dst), (src), (n))
+#define eeprom_update_block(src, dst, n) memcpy((dst), (src), (n))
+#define eeprom_read_byte(addr) (*(const uint8_t *) (addr))
+
+static inline uint16_t eeprom_read_word(const uint16_t *addr)
+{
+	uint16_t w;
+	
+	memcpy(&w, addr, sizeof(w));
+	return w;
+}
+
+static inline void eeprom_update_word(uint16_t *addr, uint16_t w)
+{
+	memcpy(addr, &w, sizeof(w));
+}
+
+// Interrupts
+
+#define ISR(vector) void vector(void)
+#define cli() host_cli()
+#define sei() host_sei()
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for(bool __irq __attribute__((__cleanup__(host_irq_cleanup))) = \
+	host_irq_save(), __todo = true; __todo; __todo = false)
+
+// Delays
+
+#define _delay_us(us) host_delay_us((uint32_t) (us))
+#define _delay_ms(ms) host_delay_us((uint32_t) ((ms) * 1000))
+
+// Interrupt vectors used by the host build
+
+void TIMER0_OVF_vect(void);
+
+// Host support
+
+void host_cli(void);
+void host_sei(void);
+bool host_irq_save(void);
+void host_irq_restore(bool disabled);
+void host_delay_us(uint32_t us);
+void host_init(void);
+
+// Restores the interrupt state when leaving an ATOMIC_BLOCK, 
+// including by return or break
+
+static inline void host_irq_cleanup(bool *disabled)
+{
+	host_irq_restore(*disabled);
+}
+
+#endif
@@ -0,0 +1,257 @@
+//
+//		host_hw.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Host hardware emulation
+ *
+ * A thread stands in for the timer 0 overflow interrupt. Each tick 
+ * advances the chip simulator by 1.024ms and then runs the firmware's 
+ * interrupt handler with the interrupt lock held. The serial port is 
+ * stdin and stdout.
+ *
+ * Environment variables:
+ *
+ * EMSIM_PROFILE	Profile file for the chip simulator (see em_sim.c)
+ * EMSIM_SPEED		Simulated time per real time, default 1. At high speeds
+ *					the foreground gets less time per tick, as it would
+ *					on a slower chip.
+ *
+ * When the profile ends, the simulator counters are printed to stderr and
+ * the program exits.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "includes.h"
+#include "em_sim.h"
+
+#define HOST_TICK_US 1024
+
+static pthread_mutex_t host_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool host_irq_disabled;
+static volatile bool host_irq_pending;			// Timer thread is waiting for the lock
+static double host_speed = 1.0;
+static int host_rx = -1;
+static struct timespec host_start;
+
+/*
+ * Disable interrupts
+ */
+
+void host_cli(void)
+{
+	if(!host_irq_disabled){
+		// A pending interrupt goes first, as it would on the chip
+		while(__atomic_load_n(&host_irq_pending, __ATOMIC_ACQUIRE))
+			sched_yield();
+		pthread_mutex_lock(&host_irq_lock);
+		host_irq_disabled = TRUE;
+	}
+}
+
+/*
+ * Enable interrupts
+ */
+ 
+void host_sei(void)
+{
+	if(host_irq_disabled){
+		host_irq_disabled = FALSE;
+		pthread_mutex_unlock(&host_irq_lock);
+	}
+}
+
+/*
+ * Disable interrupts, returning TRUE if they were already disabled
+ */
+ 
+bool host_irq_save(void)
+{
+	bool disabled = host_irq_disabled;
+	
+	host_cli();
+	return disabled;
+}
+
+/*
+ * Restore the interrupt state saved by host_irq_save()
+ */
+ 
+void host_irq_restore(bool disabled)
+{
+	if(!disabled)
+		host_sei();
+}
+
+/*
+ * Busy wait replacement, scaled to simulated time
+ */
+
+void host_delay_us(uint32_t us)
+{
+	usleep((useconds_t) (us / host_speed));
+}
+
+/*
+ * Print the run time and simulator counters
+ */
+ 
+static void host_report(void)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "{\"realtime\":\"%.3f\"}\n", (now.tv_sec - host_start.tv_sec) + 
+		(now.tv_nsec - host_start.tv_nsec) / 1e9);
+	em_sim_report(stderr);
+}
+
+/*
+ * Timer 0 overflow interrupt thread
+ */
+
+static void *host_timer_thread(void *arg)
+{
+	struct timespec next;
+	long period_ns = (long) (HOST_TICK_US * 1000.0 / host_speed);
+	bool running;
+	
+	(void) arg;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(;;){
+		next.tv_nsec += period_ns;
+		while(next.tv_nsec >= 1000000000L){
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		
+		__atomic_store_n(&host_irq_pending, TRUE, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&host_irq_lock);
+		__atomic_store_n(&host_irq_pending, FALSE, __ATOMIC_RELEASE);
+		host_irq_disabled = TRUE;
+		running = em_sim_tick(HOST_TICK_US);
+		TIMER0_OVF_vect();
+		if(!running){
+			fflush(stdout);
+			host_report();
+			exit(0);
+		}
+		host_sei();
+	}
+	return NULL;
+}
+
+/*
+ * Serial port receive, from stdin
+ */
+
+uint16_t uart0_peek(void)
+{
+	unsigned char c;
+	
+	if((host_rx < 0) && (1 == read(STDIN_FILENO, &c, 1)))
+		host_rx = c;
+	return (host_rx < 0) ? UART_NO_DATA : (uint16_t) host_rx;
+}
+
+uint16_t uart0_getc(void)
+{
+	uint16_t c = uart0_peek();
+	
+	host_rx = -1;
+	return c;
+}
+
+/*
+ * Serial port transmit, to stdout
+ */
+
+void uart0_putc(uint8_t c)
+{
+	putchar(c);
+	if(!c)
+		fflush(stdout);
+}
+
+/*
+ * Block transmit, to stdout. Line ends are \n like the rest of the 
+ * host output.
+ */
+
+void uart0_write(const void *data, uint8_t len)
+{
+	const char *p = (const char *) data;
+	
+	while(len--){
+		if('\r' != *p)
+			putchar(*p);
+		p++;
+	}
+}
+
+/*
+ * Transmit buffer space. stdout never fills.
+ */
+
+uint16_t uart0_tx_space(void)
+{
+	return UART_TX0_BUFFER_SIZE - 1;
+}
+
+/*
+ * Baud rate changes. stdout has no baud rate.
+ */
+
+void uartstream_set_baud(uint32_t baudrate)
+{
+	(void) baudrate;
+}
+
+/*
+ * Set up the host environment and start the timer interrupt
+ */
+ 
+void host_init(void)
+{
+	const char *s;
+	pthread_t thread;
+	
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+	
+	if((s = getenv("EMSIM_SPEED")) && (atof(s) > 0))
+		host_speed = atof(s);
+	if((s = getenv("EMSIM_PROFILE")) && !em_sim_load_profile(s)){
+		fprintf(stderr, "Can't load profile %s\n", s);
+		exit(1);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &host_start);
+	if(pthread_create(&thread, NULL, host_timer_thread, NULL)){
+		fprintf(stderr, "Can't start the timer thread\n");
+		exit(1);
+	}
+}
@@ -0,0 +1,82 @@
+//
+//		u8g_host.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Display stubs for the host build
+ *
+ * The host build has no display. Drawing does nothing, and each 
+ * picture loop runs once.
+ */
+
+#include "includes.h"
+
+// The display is not simulated, the stubs ignore their arguments
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+// Fonts referenced by the firmware
+
+const u8g_fntpgm_uint8_t u8g_font_5x7[1];
+const u8g_fntpgm_uint8_t u8g_font_helvR24n[1];
+
+void u8g_FirstPage(u8g_t *u8g)
+{
+}
+
+uint8_t u8g_NextPage(u8g_t *u8g)
+{
+	return 0;
+}
+
+u8g_uint_t u8g_DrawStr(u8g_t *u8g, u8g_uint_t x, u8g_uint_t y, const char *s)
+{
+	return 0;
+}
+
+void u8g_DrawBox(u8g_t *u8g, u8g_uint_t x, u8g_uint_t y, u8g_uint_t w, u8g_uint_t h)
+{
+}
+
+u8g_uint_t u8g_GetStrWidth(u8g_t *u8g, const char *s)
+{
+	return 0;
+}
+
+void u8g_SetFont(u8g_t *u8g, const u8g_fntpgm_uint8_t *font)
+{
+}
+
+void u8g_SetFontPosTop(u8g_t *u8g)
+{
+}
+
+void u8g_SetFontRefHeightText(u8g_t *u8g)
+{
+}
+
+void u8g_SetDefaultForegroundColor(u8g_t *u8g)
+{
+}
+
+void u8g_SetDefaultBackgroundColor(u8g_t *u8g)
+{
+}
@@ -7,10 +7,13 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 #include <util/atomic.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
 #include <avr/wdt.h>
+#else
+#include "host.h"
 #endif
 
 
@@ -20,13 +23,27 @@
 #include <string.h>
 
 #include "defs.h"
+#include "config.h"
 #include "pins.h"
 #include "u8g.h"
 #include "jsmn.h"
+#include "spi.h"
 #include "em.h"
+#include "cf.h"
 #include "uart.h"
 #include "uartstream.h"
 #include "timer0.h"
+#include "crc.h"
+#include "proto.h"
+#include "jsonw.h"
+#include "dispatch.h"
+#include "eelog.h"
+#include "powerfail.h"
+#include "fixfmt.h"
+#include "stats.h"
+#include "demand.h"
+#include "tou.h"
+#include "events.h"
 #include "button.h"
 #include "menu.h"
 
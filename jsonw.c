@@ -0,0 +1,326 @@
+//
+//		jsonw.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+
+/*
+ * JSON response writer
+ *
+ * Writes one JSON object straight into the UART0 transmit ring, a key 
+ * or a value at a time, without printf. jsonw_begin() checks for room 
+ * for the whole object up front, so writing it never waits on the 
+ * serial port halfway through. Objects too long for the transmit ring,
+ * such as the event list, wait as they are written instead.
+ *
+ * While a command runs, every object starts with the command's request
+ * id, so a host can match replies to commands.
+ */
+
+#include "includes.h"
+
+// Longest key
+
+#define JSONW_KEY_MAX 16
+
+static bool jsonw_first;
+static char jsonw_id[JSONW_ID_MAX];				// Request id, as JSON string content
+static uint8_t jsonw_id_len;					// 0 if there is no request id
+
+static void jsonw_key(PGM_P key);
+
+/*
+ * Set the request id to start each object with. A length of 0 clears it.
+ * 
+ * Returns FALSE, and clears the id, if it is longer than JSONW_ID_MAX
+ */
+ 
+bool jsonw_set_id(const char *id, uint8_t len)
+{
+	jsonw_id_len = 0;
+	if(len > JSONW_ID_MAX)
+		return FALSE;
+	memcpy(jsonw_id, id, len);
+	jsonw_id_len = len;
+	return TRUE;
+}
+
+/*
+ * Write the opening brace, and the request id if there is one
+ */
+ 
+static void jsonw_start(void)
+{
+	uart0_putc('{');
+	jsonw_first = TRUE;
+	if(jsonw_id_len){
+		jsonw_key(PSTR("id"));
+		uart0_write(jsonw_id, jsonw_id_len);
+		uart0_putc('"');
+	}
+}
+
+/*
+ * Test for room for an object of up to size bytes, not counting the 
+ * request id. Starts the object and returns TRUE if there is room, 
+ * otherwise returns FALSE.
+ * 
+ * The room asked for is capped at what the transmit ring can ever have
+ * free, so a larger object waits as it is written instead of forever.
+ */
+ 
+bool jsonw_try_begin(uint8_t size)
+{
+	// "id":"...",
+	uint16_t need = (uint16_t) size + (jsonw_id_len ? jsonw_id_len + 8 : 0);
+	
+	if(need > (UART_TX0_BUFFER_SIZE - 1))
+		need = UART_TX0_BUFFER_SIZE - 1;
+	if(uart0_tx_space() < need)
+		return FALSE;
+	jsonw_start();
+	return TRUE;
+}
+
+/*
+ * Wait for room for an object of up to size bytes, and start it
+ */
+ 
+void jsonw_begin(uint8_t size)
+{
+	while(!jsonw_try_begin(size));
+}
+
+/*
+ * Write a key from program memory or RAM, and the opening character of 
+ * its value
+ */
+ 
+static void jsonw_key_from(const char *key, bool progmem, char open)
+{
+	char buf[JSONW_KEY_MAX + 5];
+	uint8_t n = 0;
+	char c;
+	
+	if(!jsonw_first)
+		buf[n++] = ',';
+	jsonw_first = FALSE;
+	buf[n++] = '"';
+	while((c = (progmem ? pgm_read_byte(key) : *key)) && (n < (JSONW_KEY_MAX + 2))){
+		buf[n++] = c;
+		key++;
+	}
+	buf[n++] = '"';
+	buf[n++] = ':';
+	buf[n++] = open;
+	uart0_write(buf, n);
+}
+
+/*
+ * Write a key and the opening quote of its value
+ */
+ 
+static void jsonw_key(PGM_P key)
+{
+	jsonw_key_from(key, TRUE, '"');
+}
+
+static void jsonw_key_ram(const char *key)
+{
+	jsonw_key_from(key, FALSE, '"');
+}
+
+/*
+ * Write a key and a string value
+ */
+ 
+void jsonw_str(PGM_P key, const char *value)
+{
+	jsonw_key(key);
+	uart0_write(value, strlen(value));
+	uart0_putc('"');
+}
+
+/*
+ * Write a key from RAM and a string value
+ */
+ 
+void jsonw_str_rk(const char *key, const char *value)
+{
+	jsonw_key_ram(key);
+	uart0_write(value, strlen(value));
+	uart0_putc('"');
+}
+
+/*
+ * Write a key and a string value from program memory
+ */
+ 
+void jsonw_str_P(PGM_P key, PGM_P value)
+{
+	char c;
+	
+	jsonw_key(key);
+	while((c = pgm_read_byte(value++)))
+		uart0_putc(c);
+	uart0_putc('"');
+}
+
+/*
+ * Write a key and a fixed point value, see fixfmt()
+ */
+ 
+void jsonw_fixed(PGM_P key, uint32_t mag, bool negative, uint8_t places)
+{
+	char value[FIXFMT_MAX];
+	
+	jsonw_str(key, fixfmt(value, sizeof(value), mag, negative, places, 1, 0));
+}
+
+/*
+ * Write a key and an unsigned decimal value
+ */
+ 
+void jsonw_uint(PGM_P key, uint32_t value)
+{
+	jsonw_fixed(key, value, FALSE, 0);
+}
+
+/*
+ * Write a key from RAM and an unsigned decimal value
+ */
+ 
+void jsonw_uint_rk(const char *key, uint32_t value)
+{
+	char buf[FIXFMT_MAX];
+	
+	jsonw_str_rk(key, fixfmt(buf, sizeof(buf), value, FALSE, 0, 1, 0));
+}
+
+/*
+ * Format a 16 bit value as 4 hex digits
+ */
+ 
+static void jsonw_hex4(char *hex, uint16_t value)
+{
+	uint8_t i, d;
+	
+	for(i = 0; i < 4; i++){
+		d = (value >> (12 - (i << 2))) & 0x0F;
+		hex[i] = (d < 10) ? ('0' + d) : ('A' - 10 + d);
+	}
+}
+
+/*
+ * Write a key and a 16 bit value as 4 hex digits
+ */
+ 
+void jsonw_hex16(PGM_P key, uint16_t value)
+{
+	char hex[4];
+	
+	jsonw_hex4(hex, value);
+	jsonw_key(key);
+	uart0_write(hex, sizeof(hex));
+	uart0_putc('"');
+}
+
+/*
+ * Write a key and an array of 16 bit values as one string of 4 hex 
+ * digits per value
+ */
+ 
+void jsonw_hex_words(PGM_P key, const uint16_t *words, uint8_t count)
+{
+	char hex[4];
+	
+	jsonw_key(key);
+	while(count--){
+		jsonw_hex4(hex, *words++);
+		uart0_write(hex, sizeof(hex));
+	}
+	uart0_putc('"');
+}
+
+/*
+ * Write a key and the opening quote of a value which the caller writes 
+ * with uart0_putc(). jsonw_value_end() closes it.
+ */
+ 
+void jsonw_value_begin(PGM_P key)
+{
+	jsonw_key(key);
+}
+
+void jsonw_value_end(void)
+{
+	uart0_putc('"');
+}
+
+/*
+ * Write a key and start an array value of objects
+ */
+ 
+void jsonw_array_begin(PGM_P key)
+{
+	jsonw_key_from(key, TRUE, '[');
+	jsonw_first = TRUE;
+}
+
+/*
+ * End the array
+ */
+ 
+void jsonw_array_end(void)
+{
+	uart0_putc(']');
+	jsonw_first = FALSE;
+}
+
+/*
+ * Start an object in an array
+ */
+ 
+void jsonw_object_begin(void)
+{
+	if(!jsonw_first)
+		uart0_putc(',');
+	uart0_putc('{');
+	jsonw_first = TRUE;
+}
+
+/*
+ * End an object in an array
+ */
+ 
+void jsonw_object_end(void)
+{
+	uart0_putc('}');
+	jsonw_first = FALSE;
+}
+
+/*
+ * End the object and the line
+ */
+ 
+void jsonw_end(void)
+{
+	uart0_write("}\r\n", 3);
+}
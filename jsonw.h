@@ -0,0 +1,39 @@
+#ifndef JSONW_H
+#define JSONW_H
+
+// Longest request id echoed in replies
+
+#define JSONW_ID_MAX 8
+
+// Largest object jsonw_begin() can wait for room for with an id. The
+// transmit ring holds one byte less than its size.
+
+#define JSONW_OBJECT_MAX (UART_TX0_BUFFER_SIZE - 1 - JSONW_ID_MAX - 8)
+
+// Fail the build if a fixed object size can't fit the transmit ring
+
+#define JSONW_CHECK_SIZE(size) _Static_assert((size) <= JSONW_OBJECT_MAX, "JSON object larger than the transmit ring")
+
+// Methods
+
+bool jsonw_set_id(const char *id, uint8_t len);
+
+bool jsonw_try_begin(uint8_t size);
+void jsonw_begin(uint8_t size);
+void jsonw_str(PGM_P key, const char *value);
+void jsonw_str_rk(const char *key, const char *value);
+void jsonw_str_P(PGM_P key, PGM_P value);
+void jsonw_fixed(PGM_P key, uint32_t mag, bool negative, uint8_t places);
+void jsonw_uint(PGM_P key, uint32_t value);
+void jsonw_uint_rk(const char *key, uint32_t value);
+void jsonw_hex16(PGM_P key, uint16_t value);
+void jsonw_hex_words(PGM_P key, const uint16_t *words, uint8_t count);
+void jsonw_value_begin(PGM_P key);
+void jsonw_value_end(void);
+void jsonw_array_begin(PGM_P key);
+void jsonw_array_end(void);
+void jsonw_object_begin(void);
+void jsonw_object_end(void);
+void jsonw_end(void);
+
+#endif
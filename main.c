@@ -20,7 +20,12 @@
  * Constants
  */
 
-#define NUM_JSON_TOKENS 8						// Maximum number of json tokens to use with parser (keep small, eats RAM).
+#define NUM_JSON_TOKENS 14					// Maximum number of json tokens to use with parser (keep small, eats RAM).
+										// The tou command and an id take 14.
+#define SERIAL_BUF_SIZE 160						// Bytes of queued JSON commands, or one binary frame
+#define JSON_COMMAND_MAX 111					// Longest JSON command without whitespace
+#define REGS_MAX 32								// Most registers in one regs command
+#define SCHED_PERIOD_MIN 50						// Shortest register polling period (ms)
 
 #define IBASIC 1								// Basic current (A)
 #define VREF 240								// Reference voltage (V)
@@ -31,6 +36,11 @@
  
 #define PLC ((838860800ULL*IGAIN*MVISAMPLE*MVVSAMPLE)/(1ULL*MC*VREF*IBASIC))	// Power Line Constant
 
+#define CF_DW_NUM ((36000000ULL * CF_TICKS_PER_SEC) / MC)	// CF pulse power in 0.1W = CF_DW_NUM / pulse period
+#define ENERGY_UNITS_KWH (MC * 10U)						// Energy register units (0.1 pulses) per kWh
+#define ENERGY_SAVE_DELTA ((ENERGY_SAVE_WH * MC) / 100UL)	// Energy save threshold in 0.1 pulses
+#define DEMAND_W(e) ((uint32_t) (((e) * 360000ULL) / (1ULL * MC * DEMAND_SUBINT_SEC * DEMAND_SUBINTS)))	// Demand in W from 0.1 pulses per interval
+#define CF_LOW_LOAD_W 100						// Below this, show the CF pulse derived power
 #define MODE_WORD	0x3422						// Gain of 8 for current, rest are defaults
 
 enum {PLCONSTH=0, PLCONSTL, LGAIN, LPHI, NGAIN, NPHI, PSTARTTH, PNOLTH, QSTARTTH, QNOLTH, MMODE};
@@ -50,6 +60,47 @@ typedef struct {
 	uint16_t cal_crc;							// CRC of the calibration data
 } eeprom_cal_data_t;
 
+typedef struct {
+	uint16_t sig;								// EEPROM signature for SPI timing data
+	uint8_t profile;							// Fastest reliable SPI timing profile
+	uint16_t crc;								// CRC of the SPI timing data
+} eeprom_spitune_t;
+
+typedef struct {
+	uint16_t sig;								// EEPROM signature for the polling schedule
+	uint16_t period[15];						// Polling period for each measurement register (ms)
+	uint16_t crc;								// CRC of the polling schedule
+} eeprom_schedule_t;
+
+typedef struct {
+	uint16_t sig;								// EEPROM signature for the demand data
+	uint16_t boot;								// Power up count
+	demand_peak_t peak;							// Peak demand interval
+	uint16_t crc;								// CRC of the demand data
+} eeprom_demand_t;
+
+typedef struct {
+	uint16_t sig;								// EEPROM signature for the serial port data
+	uint8_t baud;								// Confirmed baud rate (index into baud_rates)
+	uint16_t crc;								// CRC of the serial port data
+} eeprom_baud_t;
+
+// Energy accumulators, in energy register order, then import energy 
+// for each time of use rate
+
+enum {ENERGY_IMPORT = 0, ENERGY_EXPORT, ENERGY_ABSOLUTE, ENERGY_RFORWARD, ENERGY_RREVERSE,
+	ENERGY_RABSOLUTE, ENERGY_REGS, ENERGY_TOU = ENERGY_REGS, 
+	ENERGY_COUNT = ENERGY_TOU + TOU_RATES};
+
+typedef struct {
+	uint32_t kwh;								// Whole kWh (kvarh)
+	uint16_t rem;								// Remainder (0.1 pulses, less than ENERGY_UNITS_KWH)
+} energy_acc_t;
+
+typedef struct {
+	energy_acc_t acc[ENERGY_COUNT];				// Energy accumulators
+} energy_log_t;
+
 typedef struct {
 	unsigned send_measurement_records : 1;		// Send measurement records when enabled
 } switches_t;
@@ -59,6 +110,11 @@ typedef struct {
  */
  
 eeprom_cal_data_t EEMEM eecal_eemem;
+eeprom_spitune_t EEMEM eespitune_eemem;
+eeprom_schedule_t EEMEM eesched_eemem;
+eeprom_demand_t EEMEM eedemand_eemem;
+eeprom_baud_t EEMEM eebaud_eemem;
+uint8_t EEMEM energy_log_eemem[ENERGY_LOG_SIZE];
 
 
 /*
@@ -69,30 +125,97 @@ eeprom_cal_data_t EEMEM eecal_eemem;
 
 static eeprom_cal_data_t eecal;
 
-// Button data 
+// Button data, not wired up on the host
 
+#if defined(__AVR__)
 static button_data_t button1, button2, button3;
+#endif
 
 
 
 // Display mode
 typedef enum {DISPMODE_SPLASH=0, DISPMODE_MAIN_MENU, DISPMODE_KVA, DISPMODE_KW, 
-	DISPMODE_ARMS, DISPMODE_VRMS} dispmode_t;
+	DISPMODE_ARMS, DISPMODE_VRMS, DISPMODE_STATS} dispmode_t;
 static dispmode_t dispmode, dispmode_saved;
 
-// Total forward active energy
-static uint32_t fae_total;
+// Serial protocol, JSON or binary (see proto.h), and the receive buffer
+// for the JSON command queue or a frame. A regs command writing a whole 
+// calibration range must fit.
+static bool binary_mode;
+static bool binary_eol;							// Skipping the line end after the binary command
+static uint8_t serial_buf[SERIAL_BUF_SIZE];
+
+// The JSON command queue in serial_buf. Commands waiting to run are stored
+// without whitespace, each ending with a NUL, followed by the command 
+// being received. An entry starting with a byte below ' ' is an error to 
+// reply in turn, as the error code plus one.
+static uint8_t json_queued;						// Bytes of complete entries
+static uint8_t json_rx_pos;						// End of the command being received
+static uint8_t json_rx_error;					// Error code plus one waiting for room in the queue
+
+// JSON error codes, replied as {"error":"..."}
+enum {ERR_TOOLONG = 0, ERR_TOOMANY, ERR_SYNTAX, ERR_OVERRUN, ERR_NOCOMMAND, ERR_UNKNOWN,
+	ERR_BADARG, ERR_BADID, ERR_MISSING, ERR_BADVALUE, ERR_READONLY};
+static const char err_toolong[] PROGMEM = "toolong";		// Command too long for the buffer
+static const char err_toomany[] PROGMEM = "toomany";		// Too many tokens
+static const char err_syntax[] PROGMEM = "syntax";			// Not a JSON object
+static const char err_overrun[] PROGMEM = "overrun";		// Characters lost on receive
+static const char err_nocommand[] PROGMEM = "nocommand";	// No "command" key
+static const char err_unknown[] PROGMEM = "unknown";		// No such command
+static const char err_badarg[] PROGMEM = "badarg";			// A key the command doesn't take
+static const char err_badid[] PROGMEM = "badid";			// Request id too long, or not a string or number
+static const char err_missing[] PROGMEM = "missing";		// A required argument is absent
+static const char err_badvalue[] PROGMEM = "badvalue";		// An argument is malformed or out of range
+static const char err_readonly[] PROGMEM = "readonly";		// Register can't be written
+static PGM_P const json_errors[] PROGMEM = {
+	err_toolong, err_toomany, err_syntax, err_overrun, err_nocommand, err_unknown,
+	err_badarg, err_badid, err_missing, err_badvalue, err_readonly
+};
+
+// Serial baud rates, the first is the default. The bit-banged EM chip
+// transactions hold off the receive interrupt for too long above 115200.
+#ifdef EM_SPI_SOFT
+static const uint32_t baud_rates[] PROGMEM = {9600, 115200};
+#else
+static const uint32_t baud_rates[] PROGMEM = {9600, 115200, 250000, 500000, 1000000};
+#endif
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(baud_rates[0]))
+static uint8_t baud_index;						// Current baud rate
+static uint8_t baud_fallback;					// Rate to go back to if a change isn't confirmed
+static bool baud_pending;						// Waiting for a baud rate change to be confirmed
+static uint64_t baud_timeout;
+
+// Measurement record stream. A record is only queued when the transmit
+// buffer has room for the longest one.
+#define RECORD_JSON_MAX 200
+#define RECORD_BINARY_MAX (PROTO_FRAME_MAX + 1)
+static switches_t switches;
+static uint16_t stream_interval;				// Milliseconds between records
+static uint16_t stream_fields;					// Mask of MF_ fields to send
+static uint16_t stream_skipped;					// Records skipped for lack of TX space
+static uint64_t stream_due;
+
+// Energy totals
+static energy_acc_t energy[ENERGY_COUNT];
+static uint32_t energy_unsaved;					// Active energy since the last save (0.1 pulses)
+static eelog_t energy_log;
 
 // U8clib data
 static u8g_t u8g;
 
 // The convoluted mess of putting the Menu data in program space
 const char mmi1[] PROGMEM = "Reset kWh Counter";
+#ifdef METER_STATS
+const char mmi2[] PROGMEM = "Reset Statistics";
+#endif
 const char mmiend[] PROGMEM = "";
 
 
 PGM_P const main_menu_strings[] PROGMEM = {
 	mmi1,
+#ifdef METER_STATS
+	mmi2,
+#endif
 	mmiend
 };
 
@@ -107,10 +230,94 @@ static menu_buttons_t bt_left;
 static menu_buttons_t bt_middle;
 static menu_buttons_t bt_right;
 static menu_t main_menu;
+// Measurement record, the single source of truth for the readings. 
+// Values are fixed point as read from the chip.
+
+typedef struct {
+	int16_t pmean;								// Active power (W)
+	uint16_t urms;								// Voltage (0.01V)
+	uint16_t irms;								// Current (0.001A)
+	int16_t smean;								// Apparent power (VA)
+	uint16_t freq;								// Line frequency (0.01Hz)
+	uint16_t powerf;							// Power factor (sign and magnitude, 0.001)
+	int16_t qmean;								// Reactive power (var)
+	uint16_t pangle;							// Phase angle (sign and magnitude, 0.1 degree)
+	energy_acc_t kwh;							// Forward active energy
+#ifdef EM_CF_PULSE
+	uint32_t cf_dw;								// CF pulse derived power at low load (0.1W)
+#endif
+	uint64_t ticks;								// timer0 tick count of the snapshot
+} meter_record_t;
+
+// Formatted fields
+enum {MF_KW = 0, MF_VOLTS, MF_AMPS, MF_KVA, MF_HZ, MF_PF, MF_KVAR, MF_PA, MF_KWH, MF_ELAP,
+	MF_COUNT};
+#define MF_ALL ((1U << MF_COUNT) - 1)
+
+static meter_record_t meter;
+static uint16_t meter_stale;					// Bit per formatted field which needs formatting
+
+// Formatted field cache
 static char volts[8], amps[8], kw[8], kva[8], hz[8], pf[8], kvar[8]; 
-static char pa[8], kwh[10];
+static char pa[8], kwh[16];
 static char elap[32];
 
+// Measurement snapshot. Field order must match meas_reglist.
+
+typedef struct {
+	uint16_t pmean;								// Active power
+	uint16_t urms;								// Voltage
+	uint16_t irms;								// Current
+	uint16_t smean;								// Apparent power
+	uint16_t freq;								// Line frequency
+	uint16_t apenergy;							// Forward active energy (clears on read)
+	uint16_t powerf;							// Power factor
+	uint16_t qmean;								// Reactive power
+	uint16_t pangle;							// Phase angle
+	uint16_t anenergy;							// Reverse active energy (clears on read)
+	uint16_t atenergy;							// Absolute active energy (clears on read)
+	uint16_t rpenergy;							// Forward reactive energy (clears on read)
+	uint16_t rnenergy;							// Reverse reactive energy (clears on read)
+	uint16_t rtenergy;							// Absolute reactive energy (clears on read)
+	uint16_t sysstatus;							// System status
+} meas_regs_t;
+
+// Snapshot entry indexes
+enum {MEAS_PMEAN = 0, MEAS_URMS, MEAS_IRMS, MEAS_SMEAN, MEAS_FREQ, MEAS_APENERGY, 
+	MEAS_POWERF, MEAS_QMEAN, MEAS_PANGLE, MEAS_ANENERGY, MEAS_ATENERGY, MEAS_RPENERGY, 
+	MEAS_RNENERGY, MEAS_RTENERGY, MEAS_SYSSTATUS, MEAS_COUNT};
+
+static const uint8_t meas_reglist[MEAS_COUNT] PROGMEM = {
+	EM_PMEAN, EM_URMS, EM_IRMS, EM_SMEAN, EM_FREQ, EM_APENERGY, EM_POWERF, EM_QMEAN, EM_PANGLE,
+	EM_ANENERGY, EM_ATENERGY, EM_RPENERGY, EM_ENENERGY, EM_RTENERGY, EM_SYSSTATUS
+};
+
+// Power registers, read together (see schedule_due())
+#define MEAS_POWER_GROUP (_BV(MEAS_PMEAN) | _BV(MEAS_SMEAN) | _BV(MEAS_QMEAN) | _BV(MEAS_POWERF) | _BV(MEAS_PANGLE))
+
+// Default polling periods in milliseconds, in meas_reglist order. 
+// Vrms, Irms and the status are fast to catch short events.
+static const uint16_t sched_defaults[MEAS_COUNT] PROGMEM = {
+	100, 100, 100, 250, 1000, 1000, 1000, 250, 1000, 1000, 1000, 1000, 1000, 1000, 100
+};
+
+// Snapshot entry of each energy accumulator's register
+static const uint8_t energy_meas[ENERGY_REGS] PROGMEM = {
+	MEAS_APENERGY, MEAS_ANENERGY, MEAS_ATENERGY, MEAS_RPENERGY, MEAS_RNENERGY, MEAS_RTENERGY
+};
+
+static meas_regs_t meas;
+static em_batch_t meas_batch;
+
+// Polling schedule
+
+static eeprom_schedule_t sched;
+static uint32_t sched_due[MEAS_COUNT];			// Tick count when each register is next due
+
+// Demand data
+
+static eeprom_demand_t eedemand;
+
 /*
  * Timer0 overflow interrupt
  * 
@@ -120,6 +327,8 @@ static char elap[32];
 ISR(TIMER0_OVF_vect)
 {
 	timer0_ticks64++;
+	// Advance the em chip transaction engine
+	em_service();
 	// Every 16 ticks, service the button list
 	if(!(timer0_ticks64 & 0xF))
 		button_service();		
@@ -127,39 +336,6 @@ ISR(TIMER0_OVF_vect)
 
 
 
-/*
- * Debug function. Dump registers as a set
- */
-
-void dump_words(const uint16_t *buffer, uint8_t addr, uint8_t len)
-{
-	for(uint8_t i = 0; i < len; i++, addr++)
-		printf_P(PSTR("%02X:%04X\n"), addr, buffer[i]);
-}
-
-/* 
- * Calculate CRC over buffer using polynomial: X^16 + X^12 + X^5 + 1 
- */
-
-static uint16_t calcCRC16(void *buf, int len)
-{
-	uint8_t i;
-	uint16_t crc = 0;
-	uint8_t *b = (uint8_t *) buf;
-	
-
-	while(len--){
-		crc ^= (((uint16_t) *b++) << 8);
-		for ( i = 0 ; i < 8 ; ++i ){
-			if (crc & 0x8000)
-				crc = (crc << 1) ^ 0x1021;
-			else
-				crc <<= 1;
-          	}
-	}
-	return crc;
-}
-
 /**
  * Convert a hex string into a 16 bit unsigned integer
  */
@@ -190,6 +366,61 @@ static uint8_t str2hex(uint16_t *val, const char *str)
 	return TRUE;
 }
 
+/*
+ * Format a byte as 2 hex digits
+ */
+ 
+static char *hex8(char *dest, uint8_t val)
+{
+	static const char digits[] PROGMEM = "0123456789ABCDEF";
+	
+	dest[0] = pgm_read_byte(&digits[val >> 4]);
+	dest[1] = pgm_read_byte(&digits[val & 0x0F]);
+	dest[2] = 0;
+	return dest;
+}
+
+/*
+ * Load the confirmed baud rate
+ */
+ 
+static void baud_load(void)
+{
+	eeprom_baud_t eebaud;
+	
+	eeprom_read_block(&eebaud, &eebaud_eemem, sizeof(eebaud));
+	if((0x55AA == eebaud.sig) && (calcCRC16(&eebaud, sizeof(eebaud) - sizeof(uint16_t)) == eebaud.crc) &&
+	(eebaud.baud < BAUD_RATES))
+		baud_index = eebaud.baud;
+}
+
+/*
+ * Save the confirmed baud rate
+ */
+ 
+static void baud_save(void)
+{
+	eeprom_baud_t eebaud;
+	
+	eebaud.sig = 0x55AA;
+	eebaud.baud = baud_index;
+	eebaud.crc = calcCRC16(&eebaud, sizeof(eebaud) - sizeof(uint16_t));
+	eeprom_update_block(&eebaud, &eebaud_eemem, sizeof(eebaud));
+}
+
+/*
+ * Go back to the old baud rate if a change wasn't confirmed in time
+ */
+ 
+static void baud_service(void)
+{
+	if(!baud_pending || !timer0_test_future_ms(&baud_timeout))
+		return;
+	baud_pending = FALSE;
+	baud_index = baud_fallback;
+	uartstream_set_baud(pgm_read_dword(&baud_rates[baud_index]));
+}
+
 /*
  * Initialization function
  */
@@ -197,21 +428,32 @@ static uint8_t str2hex(uint16_t *val, const char *str)
 
 static void init(void)
 {
+	// Saved serial baud rate
+	baud_load();
+	
 #if defined(__AVR__)
 	// select minimal prescaler (max system speed)
 	CLKPR = 0x80;
 	CLKPR = 0x00;
   
-	// Initialize the serial port
-	stdout = stdin = uartstream_init(9600);
+	// Initialize the serial port at the saved baud rate
+	stdout = stdin = uartstream_init(pgm_read_dword(&baud_rates[baud_index]));
+  
+	// Initialize the shared SPI bus
+	spi_init();
+	
+	// Initialize EM chip SPI (before the display starts using the bus)
+	em_init(); 
+	
+#ifdef EM_CF_PULSE
+	// Initialize CF pulse counting
+	cf_init();
+#endif
   
 	// Initialize the display
-	u8g_InitHWSPI(&u8g, &u8g_dev_st7920_128x64_hw_spi, 
+	u8g_InitHWSPI(&u8g, &u8g_dev_st7920_128x64_shared_spi, 
 	PN(1, 1), U8G_PIN_NONE, U8G_PIN_NONE);
   
-	// Initialize EM chip software SPI
-	em_init(); 
-  
 	// Set up timer 0 for 1.024ms interrupts 
 	TCCR0B |= (_BV(CS01) | _BV(CS00)); // Prescaler 16000000/64 =  250KHz
 	TIMSK0 |= _BV(TOIE0); // Enable timer overflow interrupt
@@ -224,103 +466,190 @@ static void init(void)
   
 	// Enable global interrupts
 	sei(); 
+#else
+	// Host build: simulated em chip, no display or buttons
+	em_init();
+	
+	// Start the simulated timer 0 interrupt
+	host_init();
 #endif
 }
 
 
 /*
- * Convert unsigned 16 bit integer to fixed point number
+ * Set a string to double dash followed by 4 spaces
  */
  
-static char *to_fixed_decimal_uint16(char *dest, uint8_t len, 
-uint8_t places, uint16_t val){
-	uint16_t rem;
-	uint16_t quot;
-	const char *format;
-	
-	if(2 == places){
-		rem = val % 100;
-		quot = val / 100;
-		format = PSTR("%d.%02d");
-	}
-	else{
-		rem = val % 1000;
-		quot = val / 1000;
-		format = PSTR("%d.%03d");
-	}
-	
-	/* Generate string */
-	
-	snprintf_P(dest, len, format, quot, rem);
-	return dest;
+void set_doubledash(char *str)
+{
+	strcpy_P(str, PSTR("--    "));
 }
 
 /*
- * Convert twos complement signed 16 bit integer to fixed point number
+ * Add energy register units to an energy accumulator
  */
-
-static char *twos_compl_to_fixed_decimal_int16(char *dest, uint8_t len, 
-uint8_t places, int16_t val){
-	int16_t rem;
-	int16_t quot;
-	const char *format = NULL;
+ 
+static void energy_add(energy_acc_t *acc, uint32_t units)
+{
+	uint32_t rem = acc->rem + units;
 	
-	if(1 == places){
-		rem = val%10;
-		quot = val/10;
-		format = PSTR("%d.%d");
+	// A snapshot adds at most a few kWh, so this beats dividing
+	while(rem >= ENERGY_UNITS_KWH){
+		rem -= ENERGY_UNITS_KWH;
+		acc->kwh++;
 	}
-	else if(2 == places){
-		rem = val%100;
-		quot = val/100;
-		format = PSTR("%d.%02d");
+	acc->rem = (uint16_t) rem;
+}
 
-	}
-	else{
-		rem = val%1000;
-		quot = val/1000;
-		format = PSTR("%d.%03d");
-	}
-	
-	// Adjust value when it is negative.
-	
-	if(val < 0){
-		quot *= -1;
-		rem *= -1;
-		dest[0] = '-';
-	}
-		
-	// Generate string 
-	snprintf_P((val < 0) ? dest + 1 : dest, len, format, quot, rem);
+/*
+ * Format an energy accumulator in kWh with 4 decimal places
+ */
+ 
+static char *energy_str(char *dest, uint8_t len, const energy_acc_t *acc)
+{
+	uint8_t n;
 	
+	fixfmt(dest, len, acc->kwh, FALSE, 0, 3, 0);
+	n = strlen(dest);
+	if(n + 6 > len)
+		return dest; // No room for the fraction
+	dest[n] = '.';
+	// The remainder is less than ENERGY_UNITS_KWH, so this fits 32 bits
+	fixfmt(dest + n + 1, len - n - 1, (acc->rem * 1000UL) / MC, FALSE, 0, 4, 0);
 	return dest;
 }
 
 /*
- * Convert ones complement signed 16 bit integer to fixed point number
+ * Return a formatted field of the measurement record.
+ * 
+ * Fields are only formatted when they are asked for, and then cached
+ * until the values they come from change.
  */
-
-static char *ones_compl_to_fixed_decimal_int16(char *dest, uint8_t len, 
-uint8_t places, uint16_t val){
-	int16_t twos_compl;
-	uint8_t negative = val & 0x8000 ? TRUE : FALSE;
-	
-	twos_compl = val & 0x7FFF;// Strip sign bit
+ 
+static const char *meter_str(uint8_t field)
+{
+	bool stale = (meter_stale & _BV(field)) ? TRUE : FALSE;
 	
-	if(negative)
-		twos_compl *= -1;
+	meter_stale &= ~_BV(field);
 	
-	return twos_compl_to_fixed_decimal_int16(dest, len, places, twos_compl);
+	switch(field){
+		case MF_KW:
+			if(stale){
+#ifdef EM_CF_PULSE
+				// At low load, the pulse period gives 0.1W resolution
+				if(abs(meter.pmean) < CF_LOW_LOAD_W)
+					fixfmt(kw, sizeof(kw), meter.cf_dw, (meter.pmean < 0), 4, 1, 0);
+				else
+#endif
+				fixfmt_s16(kw, sizeof(kw), 3, meter.pmean);
+			}
+			return kw;
+			
+		case MF_VOLTS:
+			if(stale)
+				fixfmt_u16(volts, sizeof(volts), 2, meter.urms);
+			return volts;
+			
+		case MF_AMPS:
+			if(stale)
+				fixfmt_u16(amps, sizeof(amps), 3, meter.irms);
+			return amps;
+			
+		case MF_KVA:
+			if(stale)
+				fixfmt_s16(kva, sizeof(kva), 3, meter.smean);
+			return kva;
+			
+		case MF_HZ:
+			if(stale)
+				fixfmt_u16(hz, sizeof(hz), 2, meter.freq);
+			return hz;
+		
+		// Power factor, kVAR and phase angle are only valid 
+		// when there is apparent power
+		
+		case MF_PF:
+			if(stale){
+				if(meter.smean)
+					fixfmt_sm16(pf, sizeof(pf), 3, meter.powerf);
+				else
+					set_doubledash(pf);
+			}
+			return pf;
+			
+		case MF_KVAR:
+			if(stale){
+				if(meter.smean)
+					fixfmt_s16(kvar, sizeof(kvar), 3, meter.qmean);
+				else
+					set_doubledash(kvar);
+			}
+			return kvar;
+			
+		case MF_PA:
+			if(stale){
+				if(meter.smean)
+					fixfmt_sm16(pa, sizeof(pa), 1, meter.pangle);
+				else
+					set_doubledash(pa);
+			}
+			return pa;
+			
+		case MF_KWH:
+			if(stale)
+				energy_str(kwh, sizeof(kwh), &meter.kwh);
+			return kwh;
+			
+		case MF_ELAP:
+			if(stale)
+				timer0_ticks_to_elapsed_time(meter.ticks, elap, sizeof(elap));
+			return elap;
+			
+		default:
+			return "";
+	}
 }
 
-
 /*
- * Set a string to double dash followed by 4 spaces
+ * Replace the measurement record, and mark the formatted fields 
+ * whose values changed.
  */
  
-void set_doubledash(char *str)
+static void meter_update(const meter_record_t *rec)
 {
-	strcpy_P(str, PSTR("--    "));
+	uint16_t stale = 0;
+	
+	if(rec->pmean != meter.pmean)
+		stale |= _BV(MF_KW);
+#ifdef EM_CF_PULSE
+	if(rec->cf_dw != meter.cf_dw)
+		stale |= _BV(MF_KW);
+#endif
+	if(rec->urms != meter.urms)
+		stale |= _BV(MF_VOLTS);
+	if(rec->irms != meter.irms)
+		stale |= _BV(MF_AMPS);
+	if(rec->smean != meter.smean)
+		stale |= _BV(MF_KVA) | _BV(MF_PF) | _BV(MF_KVAR) | _BV(MF_PA);
+	if(rec->freq != meter.freq)
+		stale |= _BV(MF_HZ);
+	if(rec->powerf != meter.powerf)
+		stale |= _BV(MF_PF);
+	if(rec->qmean != meter.qmean)
+		stale |= _BV(MF_KVAR);
+	if(rec->pangle != meter.pangle)
+		stale |= _BV(MF_PA);
+	if((rec->kwh.kwh != meter.kwh.kwh) || (rec->kwh.rem != meter.kwh.rem))
+		stale |= _BV(MF_KWH);
+	if(rec->ticks != meter.ticks)
+		stale |= _BV(MF_ELAP);
+	
+	// Format everything the first time
+	if(!meter.ticks)
+		stale = 0xFFFF;
+		
+	meter = *rec;
+	meter_stale |= stale;
 }
 
 /*
@@ -336,14 +665,47 @@ static void clear_screen(void)
     } while ( u8g_NextPage(&u8g) );
 }
 
+/*
+ * Save the energy totals to the EEPROM log
+ */
+ 
+static void energy_save(void)
+{
+	energy_log_t elog;
+	
+	memcpy(elog.acc, energy, sizeof(elog.acc));
+	eelog_write(&energy_log, &elog);
+	energy_unsaved = 0;
+}
+
+/*
+ * Restore the energy totals from the EEPROM log
+ */
+ 
+static void energy_load(void)
+{
+	energy_log_t elog;
+	
+	if(eelog_init(&energy_log, energy_log_eemem, sizeof(energy_log_eemem), sizeof(elog)) &&
+	eelog_read(&energy_log, &elog))
+		memcpy(energy, elog.acc, sizeof(energy));
+}
+
 /*
  * Reset kWh
  */
  
 static void reset_kwh(void)
 {
-	em_read_transaction(EM_APENERGY);
-	fae_total = 0UL;
+	uint8_t addr;
+	
+	// Clear the energy registers
+	for(addr = EM_APENERGY; addr <= EM_RTENERGY; addr++)
+		em_read_transaction(addr);
+	memset(energy, 0, sizeof(energy));
+	memset(&meter.kwh, 0, sizeof(meter.kwh));
+	meter_stale |= _BV(MF_KWH);
+	energy_save();
 }
 
 
@@ -376,9 +738,12 @@ static void draw_splash(void)
  * Draw meter data on graphic display
  */
 
-static void draw_meter_data(char *volts, char *amps, char *kw, 
-	char *kva, char *hz, char *pf, char *kvar, char *pa, char *kwh)
+static void draw_meter_data(void)
 {
+	const char *volts = meter_str(MF_VOLTS);
+	const char *amps = meter_str(MF_AMPS);
+	const char *kw = meter_str(MF_KW);
+	const char *kva = meter_str(MF_KVA);
 	
 	const char *l_kw = PSTR("kW");
 	const char *l_vrms = PSTR("Vrms");
@@ -470,15 +835,15 @@ static void draw_meter_data(char *volts, char *amps, char *kw,
 	
 		
 	// These fields stay the same from page to page		 
-	u8g_DrawStr(&u8g, column3, line3, hz); 
+	u8g_DrawStr(&u8g, column3, line3, meter_str(MF_HZ)); 
 	drawstr_P(&u8g, column4, line3, l_hz); 
-	u8g_DrawStr(&u8g, column1, line4, pf); 
+	u8g_DrawStr(&u8g, column1, line4, meter_str(MF_PF)); 
 	drawstr_P(&u8g, column2, line4, l_pf); 
-	u8g_DrawStr(&u8g, column3, line4, kvar); 
+	u8g_DrawStr(&u8g, column3, line4, meter_str(MF_KVAR)); 
 	drawstr_P(&u8g, column4, line4, l_kvar); 
-	u8g_DrawStr(&u8g, column1, line5, pa); 
+	u8g_DrawStr(&u8g, column1, line5, meter_str(MF_PA)); 
 	drawstr_P(&u8g, column2, line5, l_ph); 
-	u8g_DrawStr(&u8g, column3, line5, kwh);
+	u8g_DrawStr(&u8g, column3, line5, meter_str(MF_KWH));
 	drawstr_P(&u8g, column4, line5, l_kwh);
 	
 	// Soft buttons
@@ -487,6 +852,94 @@ static void draw_meter_data(char *volts, char *amps, char *kw,
   
 }
 
+#ifdef METER_STATS
+
+// Statistics page window
+static uint8_t stats_window;
+
+// Statistics quantity names and decimal places
+static const char stats_name_vrms[] PROGMEM = "vrms";
+static const char stats_name_irms[] PROGMEM = "irms";
+static const char stats_name_kw[] PROGMEM = "kw";
+static const char stats_name_kva[] PROGMEM = "kva";
+static const char stats_name_pf[] PROGMEM = "pf";
+static const char stats_name_hz[] PROGMEM = "hz";
+
+static PGM_P const stats_names[STATS_QUANTITIES] PROGMEM = {
+	stats_name_vrms, stats_name_irms, stats_name_kw, 
+	stats_name_kva, stats_name_pf, stats_name_hz
+};
+
+static const uint8_t stats_places[STATS_QUANTITIES] PROGMEM = {2, 3, 3, 3, 3, 2};
+
+/*
+ * Format a statistics value
+ */
+ 
+static char *stats_str(char *dest, uint8_t len, uint8_t quantity, int32_t value)
+{
+	return fixfmt(dest, len, (uint32_t) labs(value), (value < 0),
+		pgm_read_byte(&stats_places[quantity]), 1, 0);
+}
+
+/*
+ * Feed the statistics with the readings which were part of a snapshot
+ */
+ 
+static void stats_feed(const meter_record_t *rec, uint16_t mask)
+{
+	int16_t pf;
+	
+	if(mask & _BV(MEAS_URMS))
+		stats_sample(STATS_VRMS, rec->urms);
+	if(mask & _BV(MEAS_IRMS))
+		stats_sample(STATS_IRMS, rec->irms);
+	if(mask & _BV(MEAS_PMEAN))
+		stats_sample(STATS_KW, rec->pmean);
+	if(mask & _BV(MEAS_SMEAN))
+		stats_sample(STATS_KVA, rec->smean);
+	// Power factor is meaningless with no load
+	if((mask & _BV(MEAS_POWERF)) && rec->smean){
+		pf = (int16_t) (rec->powerf & 0x7FFF);
+		stats_sample(STATS_PF, (rec->powerf & 0x8000) ? -pf : pf);
+	}
+	if(mask & _BV(MEAS_FREQ))
+		stats_sample(STATS_HZ, rec->freq);
+}
+
+/*
+ * Draw the statistics page
+ */
+
+static void draw_stats(void)
+{
+	char name[5];
+	char value[8];
+	stats_result_t res;
+	uint8_t q, y;
+	const uint8_t column1 = 0;
+	const uint8_t column2 = 22;
+	const uint8_t column3 = 57;
+	const uint8_t column4 = 92;
+	
+	u8g_SetFont(&u8g, u8g_font_5x7);
+	u8g_DrawStr(&u8g, column1, 8, fixfmt_u16(value, sizeof(value), 0, stats_window_secs(stats_window)));
+	drawstr_P(&u8g, column2, 8, PSTR("s min"));
+	drawstr_P(&u8g, column3, 8, PSTR("avg"));
+	drawstr_P(&u8g, column4, 8, PSTR("max"));
+	
+	for(q = 0, y = 16; q < STATS_QUANTITIES; q++, y += 8){
+		u8g_DrawStr(&u8g, column1, y, strcpy_P(name, (PGM_P) pgm_read_ptr(&stats_names[q])));
+		if(!stats_get(stats_window, q, &res))
+			continue;
+		u8g_DrawStr(&u8g, column2, y, stats_str(value, sizeof(value), q, res.min));
+		u8g_DrawStr(&u8g, column3, y, stats_str(value, sizeof(value), q, res.mean));
+		u8g_DrawStr(&u8g, column4, y, stats_str(value, sizeof(value), q, res.max));
+	}
+}
+
+#endif
+
 /*
  * Search for a key in the json string.
  * Return -1 if not found, or the key index if found
@@ -496,11 +949,12 @@ static void draw_meter_data(char *volts, char *amps, char *kw,
 int16_t json_key_index(const char *json, jsmntok_t *tokens, PGM_P key)
 {
 	uint8_t i;
+	uint8_t keylen = strlen_P(key);
 	// Test every other token starting with the second token.
 	for(i = 1; i < NUM_JSON_TOKENS; i += 2){
 		if(tokens[i].type == JSMN_STRING){
 			uint8_t len = tokens[i].end - tokens[i].start;
-			if(strlen_P(key) == len){
+			if(keylen == len){
 				if(!strncmp_P(json + tokens[i].start, key, len)){
 					return i;
 				}
@@ -537,199 +991,1378 @@ void json_value(const char *json, jsmntok_t *tokens, int16_t index, char *value,
 }
 
 /*
- * Perform register command
+ * Find the fastest reliable SPI timing for the em chip.
+ * 
+ * Uses the stored profile if it still checks out, otherwise runs 
+ * the calibration and stores the result. Must be called after the 
+ * calibration registers have been written.
  */
-static void do_register_command(const char *line, jsmntok_t *tokens)
+ 
+static void tune_spi(void)
 {
-	int16_t addrtok, valuetok;
-	char addr_s[3], value_s[5];
-	uint16_t addr, value;
+	eeprom_spitune_t tune;
+	const uint8_t addrs[] = {EM_PLCONSTH, EM_PLCONSTL, EM_MMODE};
+	const uint16_t expected[] = {eecal.meter_cal[PLCONSTH], eecal.meter_cal[PLCONSTL], eecal.meter_cal[MMODE]};
 	
-	// Check for address 
+	eeprom_read_block(&tune, &eespitune_eemem, sizeof(tune));
+	if((0x55AA == tune.sig) && (calcCRC16(&tune, sizeof(tune) - sizeof(uint16_t)) == tune.crc)){
+		em_set_timing(tune.profile);
+		if(em_check_timing(sizeof(addrs), addrs, expected))
+			return; // Stored profile is good
+	}
 	
-	addrtok = json_key_index(line, tokens, PSTR("addr"));
-	if(addrtok < 1)
-		return; // Address not present
-		
-	// Extract address
-	json_value(line, tokens, addrtok + 1, addr_s, sizeof(addr_s));
-	if(!str2hex(&addr, addr_s))
-		return; // Bad address
+	// Calibrate and store the result
+	tune.sig = 0x55AA;
+	tune.profile = em_tune_timing(sizeof(addrs), addrs, expected);
+	tune.crc = calcCRC16(&tune, sizeof(tune) - sizeof(uint16_t));
+	eeprom_update_block(&tune, &eespitune_eemem, sizeof(tune));
+}
 
-	if(addr > 0x6F)
-		return; // Address out of range
-		
-	printf_P(PSTR("Addr: %s\n"), addr_s);
+#ifdef EM_CF_PULSE
+/*
+ * Return the power from a CF pulse channel in 0.1W (0.1var) units, 
+ * 0 if it is not known
+ */
+ 
+static uint32_t cf_power_dw(uint8_t chan)
+{
+	uint32_t period = cf_period(chan);
 	
-	// Get the value index if it exists
-	valuetok = json_key_index(line, tokens, PSTR("value"));
+	return period ? (uint32_t) (CF_DW_NUM / period) : 0;
+}
+#endif
 
-	// If value specified, then it is a write
-	if(valuetok > 0){
-		uint8_t offset;
-		uint16_t cs;
-		// Check for valid write address
-		if((addr != 0) && (addr != 2) && (addr != 3)  && (addr != 4)){
-			if((addr < 0x21) || (addr > 0x3B))
-				return;
-			if((addr > 0x2B) && (addr < 0x30))
-				return;
-		}
+/*
+ * Load the polling schedule from EEPROM, or use the defaults
+ */
+ 
+static void schedule_init(void)
+{
+	uint8_t i;
 	
-			
-		// Extract value
-		json_value(line, tokens, valuetok + 1, value_s, sizeof(value_s));
-		if(!str2hex(&value, value_s))
-		return; // Bad value
-		
-		// Determine range
-		
-		if(addr < 0x20){
-			// Status and special registers
-			// Write not implemented
-			return;
-		}
-			
-		else if(addr < 0x30){			
-			// Metering calibration range
-			offset = addr - EM_CAL_FIRST;
-			eecal.meter_cal[offset] = value;
-			// Unlock meter cal
-			em_write_transaction(EM_CALSTART, 0x5678);
-			// Rewrite the block to the em chip
-			cs = em_write_block(EM_CAL_FIRST, EM_CAL_LAST, eecal.meter_cal);
-			// Write the new checksum
-			em_write_transaction(EM_CS1, cs);
-			// Lock the meter cal
-			em_write_transaction(EM_CALSTART, 0x8765);
-		}
-		
-		else{
-			// Measurement calibration range
-			offset = addr - EM_MEAS_FIRST;
-			eecal.measure_cal[offset] = value;
-			// Unlock meter cal
-			em_write_transaction(EM_ADJSTART, 0x5678);
-			// Rewrite the block to the em chip
-			cs = em_write_block(EM_MEAS_FIRST, EM_MEAS_LAST, eecal.measure_cal);
-			// Write the new checksum
-			em_write_transaction(EM_CS2, cs);
-			// Lock the meter cal
-			em_write_transaction(EM_ADJSTART, 0x8765);
-		}
-		// Update EEPROM
-		eecal.cal_crc = calcCRC16(&eecal, (sizeof(eecal) - sizeof(uint16_t)));
-		eeprom_update_block(&eecal, &eecal_eemem, sizeof(eecal));
-	}
-	else{
-			// Read value from em chip
-			value = em_read_transaction(addr);
+	eeprom_read_block(&sched, &eesched_eemem, sizeof(sched));
+	if((0x55AA != sched.sig) || (calcCRC16(&sched, sizeof(sched) - sizeof(uint16_t)) != sched.crc)){
+		sched.sig = 0x55AA;
+		for(i = 0; i < MEAS_COUNT; i++)
+			sched.period[i] = pgm_read_word(&sched_defaults[i]);
 	}
-	printf_P(PSTR("{\"value\":\"%04X\"}\n"), value);
 }
-	
 
 /*
- * Process a command line
+ * Save the demand data
  */
+ 
+static void demand_save(void)
+{
+	eedemand.peak = *demand_peak();
+	eedemand.crc = calcCRC16(&eedemand, sizeof(eedemand) - sizeof(uint16_t));
+	eeprom_update_block(&eedemand, &eedemand_eemem, sizeof(eedemand));
+}
 
+/*
+ * Load the peak demand and count this power up
+ */
  
-static void process_command(char *line)
-{
-	//char *p;
-	//uint16_t reg,val;
-	//uint8_t len = strlen(line);
-	//static uint8_t upper = 0, lower = 0;
-	//static uint16_t *cal_data = NULL;
-	//static uint16_t dump_buf[16];
-	//uint16_t cs;
-	jsmnerr_t json_res;
-	jsmn_parser json_parser;
-	int16_t res;
-	char command[12];
-	jsmntok_t tokens[NUM_JSON_TOKENS];
+static void demand_load(void)
+{
+	eeprom_read_block(&eedemand, &eedemand_eemem, sizeof(eedemand));
+	if((0x55AA != eedemand.sig) || (calcCRC16(&eedemand, sizeof(eedemand) - sizeof(uint16_t)) != eedemand.crc)){
+		memset(&eedemand, 0, sizeof(eedemand));
+		eedemand.sig = 0x55AA;
+	}
+	eedemand.boot++;
+	demand_init(&eedemand.peak, eedemand.boot);
+	demand_save();
+}
+
+/*
+ * Return a mask of the measurement registers which are due to be read,
+ * and set their next due times.
+ * 
+ * Related registers are read together, so a record never pairs a fresh
+ * value with a stale one: the power registers whenever one of them is 
+ * due, and the voltage with the status, which drive the sag events.
+ */
+ 
+static uint16_t schedule_due(void)
+{
+	uint8_t i;
+	uint16_t mask = 0;
+	uint32_t now = timer0_ticks();
+	
+	for(i = 0; i < MEAS_COUNT; i++){
+		if((int32_t) (now - sched_due[i]) >= 0){
+			mask |= _BV(i);
+			sched_due[i] = now + timer0_ms_to_ticks(sched.period[i]);
+		}
+	}
+	if(mask & MEAS_POWER_GROUP)
+		mask |= MEAS_POWER_GROUP;
+	if(mask & _BV(MEAS_SYSSTATUS))
+		mask |= _BV(MEAS_URMS);
+	return mask;
+}
+
+/*
+ * Reply with a JSON error code
+ */
+ 
+static void json_error(uint8_t error)
+{
+	jsonw_begin(24);
+	jsonw_str_P(PSTR("error"), (PGM_P) pgm_read_ptr(&json_errors[error]));
+	jsonw_end();
+}
+
+/*
+ * Perform schedule command
+ * 
+ * With addr and period, sets the polling period of a measurement
+ * register in milliseconds and saves the schedule. Periods shorter than
+ * SCHED_PERIOD_MIN are rejected.
+ * Always replies with the polling period of every register.
+ */
+ 
+static void do_schedule_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t addrtok, periodtok;
+	char addr_s[3], period_s[7], key[3];
+	char *end;
+	uint16_t addr;
+	uint32_t period;
+	uint8_t i;
+	
+	addrtok = json_key_index(line, tokens, PSTR("addr"));
+	periodtok = json_key_index(line, tokens, PSTR("period"));
+	
+	if((addrtok > 0) && (periodtok > 0)){
+		json_value(line, tokens, addrtok + 1, addr_s, sizeof(addr_s));
+		if(!str2hex(&addr, addr_s)){
+			json_error(ERR_BADVALUE); // Bad address
+			return;
+		}
+		json_value(line, tokens, periodtok + 1, period_s, sizeof(period_s));
+		period = strtoul(period_s, &end, 10);
+		if(!period_s[0] || *end || (period < SCHED_PERIOD_MIN) || (period > 0xFFFF)){
+			json_error(ERR_BADVALUE); // Bad period
+			return;
+		}
+		// Find the register
+		for(i = 0; i < MEAS_COUNT; i++){
+			if(pgm_read_byte(&meas_reglist[i]) == addr)
+				break;
+		}
+		if(i == MEAS_COUNT){
+			json_error(ERR_BADVALUE); // Not a polled register
+			return;
+		}
+		sched.period[i] = (uint16_t) period;
+		sched_due[i] = timer0_ticks();
+		// Save the schedule
+		sched.crc = calcCRC16(&sched, sizeof(sched) - sizeof(uint16_t));
+		eeprom_update_block(&sched, &eesched_eemem, sizeof(sched));
+	}
+	else if((addrtok > 0) || (periodtok > 0)){
+		json_error(ERR_MISSING); // Need both
+		return;
+	}
+	
+	// Report the schedule
+	JSONW_CHECK_SIZE(MEAS_COUNT * 14);
+	jsonw_begin(MEAS_COUNT * 14);
+	for(i = 0; i < MEAS_COUNT; i++){
+		hex8(key, pgm_read_byte(&meas_reglist[i]));
+		jsonw_uint_rk(key, sched.period[i]);
+	}
+	jsonw_end();
+}
+
+/*
+ * Perform energy command
+ * 
+ * Reports all the energy totals, in kWh and kvarh, and the import 
+ * energy at each time of use rate
+ */
+
+static void do_energy_command(const char *line, jsmntok_t *tokens)
+{
+	static const char n_import[] PROGMEM = "import";
+	static const char n_export[] PROGMEM = "export";
+	static const char n_absolute[] PROGMEM = "absolute";
+	static const char n_rforward[] PROGMEM = "rforward";
+	static const char n_rreverse[] PROGMEM = "rreverse";
+	static const char n_rabsolute[] PROGMEM = "rabsolute";
+	static const char n_rate1[] PROGMEM = "rate1";
+	static const char n_rate2[] PROGMEM = "rate2";
+	static const char n_rate3[] PROGMEM = "rate3";
+	static const char n_rate4[] PROGMEM = "rate4";
+	static PGM_P const names[ENERGY_COUNT] PROGMEM = {
+		n_import, n_export, n_absolute, n_rforward, n_rreverse, n_rabsolute,
+		n_rate1, n_rate2, n_rate3, n_rate4
+	};
+	char value[16];
+	uint8_t i;
+	
+	(void) line;
+	(void) tokens;
+	
+	// Longer than the transmit ring with an id, written as it drains
+	jsonw_begin(24);
+	for(i = 0; i < ENERGY_COUNT; i++)
+		jsonw_str((PGM_P) pgm_read_ptr(&names[i]), energy_str(value, sizeof(value), &energy[i]));
+	jsonw_end();
+}
+
+/*
+ * Perform clock command
+ * 
+ * "time" sets the clock to local time in seconds since 1970
+ */
+ 
+static void do_clock_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t tok;
+	char time_s[11];
+	char *end;
+	uint32_t secs;
+	bool synced;
+	
+	tok = json_key_index(line, tokens, PSTR("time"));
+	if(tok > 0){
+		json_value(line, tokens, tok + 1, time_s, sizeof(time_s));
+		secs = strtoul(time_s, &end, 10);
+		if(!time_s[0] || *end){
+			json_error(ERR_BADVALUE); // Bad time
+			return;
+		}
+		tou_set_clock(secs);
+	}
+	
+	synced = tou_get_clock(&secs);
+	jsonw_begin(40);
+	jsonw_uint(PSTR("time"), secs);
+	jsonw_uint(PSTR("synced"), synced);
+	jsonw_uint(PSTR("rate"), tou_rate() + 1);
+	jsonw_end();
+}
+
+/*
+ * Convert a HHMM time of day string, exactly 4 digits, to a time of use
+ * schedule slot
+ */
+ 
+static bool hhmm_to_slot(const char *hhmm, uint8_t *slot)
+{
+	char *end;
+	uint16_t t = (uint16_t) strtoul(hhmm, &end, 10);
+	uint8_t mm = t % 100;
+	
+	if((4 != strlen(hhmm)) || *end || (mm >= 60) || (mm % TOU_SLOT_MIN) || (t > 2400))
+		return FALSE;
+	*slot = (uint8_t) ((t / 100) * (60 / TOU_SLOT_MIN) + (mm / TOU_SLOT_MIN));
+	return TRUE;
+}
+
+/*
+ * Perform tou command
+ * 
+ * "day" (weekday or weekend), "from" and "to" (HHMM) and "rate" (1-4)
+ * set the rate of part of the schedule. Reports the schedule as a rate 
+ * digit for each slot.
+ */
+ 
+static void do_tou_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t daytok, fromtok, totok, ratetok;
+	// One character longer than any valid value, so longer ones are not
+	// truncated into valid ones
+	char day_s[9], from_s[6], to_s[6], rate_s[3];
+	uint8_t daytype, from, to, slot;
+	
+	daytok = json_key_index(line, tokens, PSTR("day"));
+	fromtok = json_key_index(line, tokens, PSTR("from"));
+	totok = json_key_index(line, tokens, PSTR("to"));
+	ratetok = json_key_index(line, tokens, PSTR("rate"));
+	
+	if((daytok > 0) && (fromtok > 0) && (totok > 0) && (ratetok > 0)){
+		json_value(line, tokens, daytok + 1, day_s, sizeof(day_s));
+		json_value(line, tokens, fromtok + 1, from_s, sizeof(from_s));
+		json_value(line, tokens, totok + 1, to_s, sizeof(to_s));
+		json_value(line, tokens, ratetok + 1, rate_s, sizeof(rate_s));
+		if(!strcmp_P(day_s, PSTR("weekday")))
+			daytype = TOU_WEEKDAY;
+		else if(!strcmp_P(day_s, PSTR("weekend")))
+			daytype = TOU_WEEKEND;
+		else{
+			json_error(ERR_BADVALUE); // Bad day type
+			return;
+		}
+		if(!hhmm_to_slot(from_s, &from) || !hhmm_to_slot(to_s, &to)){
+			json_error(ERR_BADVALUE); // Bad time
+			return;
+		}
+		if((rate_s[0] < '1') || (rate_s[0] > '0' + TOU_RATES) || rate_s[1]){
+			json_error(ERR_BADVALUE); // Bad rate
+			return;
+		}
+		tou_set_slots(daytype, from % TOU_SLOTS, to, rate_s[0] - '1');
+	}
+	else if((daytok > 0) || (fromtok > 0) || (totok > 0) || (ratetok > 0)){
+		json_error(ERR_MISSING); // Need all four
+		return;
+	}
+	
+	JSONW_CHECK_SIZE(TOU_DAYTYPES * (TOU_SLOTS + 14));
+	jsonw_begin(TOU_DAYTYPES * (TOU_SLOTS + 14));
+	for(daytype = 0; daytype < TOU_DAYTYPES; daytype++){
+		jsonw_value_begin((TOU_WEEKDAY == daytype) ? PSTR("weekday") : PSTR("weekend"));
+		for(slot = 0; slot < TOU_SLOTS; slot++)
+			uart0_putc('1' + tou_get_slot(daytype, slot));
+		jsonw_value_end();
+	}
+	jsonw_end();
+}
+
+/*
+ * Perform events command
+ * 
+ * Reports the events in progress and the finished events, newest first.
+ * "saved" reports the events saved in EEPROM instead.
+ */
+ 
+static void do_events_command(const char *line, jsmntok_t *tokens)
+{
+	static const char t_sag[] PROGMEM = "sag";
+	static const char t_swell[] PROGMEM = "swell";
+	static const char t_oc[] PROGMEM = "overcurrent";
+	static PGM_P const types[EVENT_TYPES] PROGMEM = {t_sag, t_swell, t_oc};
+	bool saved = (json_key_index(line, tokens, PSTR("saved")) > 0);
+	uint64_t now;
+	event_t ev;
+	uint8_t i;
+	bool active;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		now = timer0_ticks64;
+	}
 	
-	// Initialize JSON parser
-	jsmn_init(&json_parser);
+	// Longer than the transmit ring, written as it drains
+	jsonw_begin(16);
+	jsonw_array_begin(PSTR("events"));
+	for(i = 0; ; i++){
+		// Events in progress first
+		active = !saved && (i < EVENT_TYPES);
+		if(active){
+			if(!events_active(i, &ev, now))
+				continue;
+		}
+		else if(!(saved ? events_get_saved(i, &ev) : events_get(i - EVENT_TYPES, &ev)))
+			break;
+		jsonw_object_begin();
+		jsonw_str_P(PSTR("type"), (PGM_P) pgm_read_ptr(&types[ev.type & ~EVENT_SYNCED]));
+		jsonw_uint(PSTR("start"), ev.start);
+		jsonw_uint(PSTR("synced"), (ev.type & EVENT_SYNCED) ? 1 : 0);
+		jsonw_uint(PSTR("duration"), ev.duration);
+		jsonw_fixed(PSTR("extreme"), ev.extreme, FALSE, 
+			((ev.type & ~EVENT_SYNCED) == EVENT_OVERCURRENT) ? 3 : 2);
+		jsonw_uint(PSTR("active"), active);
+		jsonw_object_end();
+	}
+	jsonw_array_end();
+	jsonw_end();
+}
+
+/*
+ * Perform demand command
+ * 
+ * Reports the demand in kW. "resetpeak" clears the peak.
+ */
+ 
+static void do_demand_command(const char *line, jsmntok_t *tokens)
+{
+	char current[FIXFMT_MAX], last[FIXFMT_MAX], peak[FIXFMT_MAX];
+	uint32_t energy;
+	const demand_peak_t *pk;
+	
+	if(json_key_index(line, tokens, PSTR("resetpeak")) > 0){
+		demand_reset_peak();
+		demand_save();
+	}
+	
+	fixfmt(current, sizeof(current), DEMAND_W(demand_current()), FALSE, 3, 1, 0);
+	if(demand_last(&energy))
+		fixfmt(last, sizeof(last), DEMAND_W(energy), FALSE, 3, 1, 0);
+	else
+		strcpy_P(last, PSTR("--"));
+	pk = demand_peak();
+	fixfmt(peak, sizeof(peak), DEMAND_W(pk->energy), FALSE, 3, 1, 0);
+	jsonw_begin(120);
+	jsonw_uint(PSTR("interval"), DEMAND_SUBINT_SEC * DEMAND_SUBINTS);
+	jsonw_str(PSTR("current"), current);
+	jsonw_str(PSTR("last"), last);
+	jsonw_str(PSTR("peak"), peak);
+	jsonw_uint(PSTR("peakboot"), pk->boot);
+	jsonw_uint(PSTR("peaksecs"), pk->secs);
+	jsonw_uint(PSTR("boot"), eedemand.boot);
+	jsonw_end();
+}
+
+#ifdef METER_STATS
+/*
+ * Make a stats reply key from a quantity name and a suffix
+ */
+ 
+static char *stats_key(char *key, uint8_t q, PGM_P suffix)
+{
+	strcpy_P(key, (PGM_P) pgm_read_ptr(&stats_names[q]));
+	return strcat_P(key, suffix);
+}
+
+/*
+ * Perform stats command
+ * 
+ * Reports the statistics of the last completed window. "window" selects
+ * the window (0-2, default 0), "reset" discards all statistics.
+ */
+ 
+static void do_stats_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t tok;
+	char window_s[4], key[8], value[FIXFMT_MAX];
+	uint8_t window = STATS_WIN0, q;
+	stats_result_t res;
+	
+	if(json_key_index(line, tokens, PSTR("reset")) > 0)
+		stats_reset();
+	
+	tok = json_key_index(line, tokens, PSTR("window"));
+	if(tok > 0){
+		json_value(line, tokens, tok + 1, window_s, sizeof(window_s));
+		window = (uint8_t) atoi(window_s);
+		if(window >= STATS_WINDOWS){
+			json_error(ERR_BADVALUE); // Bad window
+			return;
+		}
+	}
+	
+	// Longer than the transmit ring, written as it drains
+	jsonw_begin(32);
+	jsonw_uint(PSTR("window"), stats_window_secs(window));
+	for(q = 0; q < STATS_QUANTITIES; q++){
+		if(!stats_get(window, q, &res)){
+			jsonw_uint_rk(stats_key(key, q, PSTR("n")), 0);
+			continue;
+		}
+		jsonw_uint_rk(stats_key(key, q, PSTR("n")), res.count);
+		jsonw_str_rk(stats_key(key, q, PSTR("min")), stats_str(value, sizeof(value), q, res.min));
+		jsonw_str_rk(stats_key(key, q, PSTR("avg")), stats_str(value, sizeof(value), q, res.mean));
+		jsonw_str_rk(stats_key(key, q, PSTR("max")), stats_str(value, sizeof(value), q, res.max));
+		// Variance is in the square of the units
+		jsonw_str_rk(stats_key(key, q, PSTR("var")), fixfmt(value, sizeof(value), res.var, FALSE, 
+			pgm_read_byte(&stats_places[q]) << 1, 1, 0));
+	}
+	jsonw_end();
+}
+#endif
+
+/*
+ * Add the measurement record fields in a mask to a binary payload, 
+ * in the PROTO_OP_QUERY layout. Return the next position.
+ */
+
+static uint8_t binary_record(uint8_t *buf, uint8_t n, uint16_t fields)
+{
+	uint8_t i;
+	
+	if(fields & _BV(MF_ELAP))
+		n = proto_put32(buf, n, (uint32_t) meter.ticks);
+	// The record's first eight members are in MF_ order
+	for(i = MF_KW; i <= MF_PA; i++){
+		if(fields & _BV(i))
+			n = proto_put16(buf, n, ((const uint16_t *) &meter)[i]);
+	}
+	if(fields & _BV(MF_KWH)){
+		n = proto_put32(buf, n, meter.kwh.kwh);
+		n = proto_put16(buf, n, meter.kwh.rem);
+	}
+	return n;
+}
+
+/*
+ * Write the measurement record fields in a mask as a JSON object, 
+ * once the transmit buffer has room for the longest record
+ */
+ 
+static void json_record(uint16_t fields)
+{
+	static const char f_pmean[] PROGMEM = "pmean";
+	static const char f_urms[] PROGMEM = "urms";
+	static const char f_irms[] PROGMEM = "irms";
+	static const char f_smean[] PROGMEM = "smean";
+	static const char f_freq[] PROGMEM = "freq";
+	static const char f_powerf[] PROGMEM = "powerf";
+	static const char f_qmean[] PROGMEM = "qmean";
+	static const char f_pangle[] PROGMEM = "pangle";
+	static const char f_kwh[] PROGMEM = "kwh";
+	static const char f_elap[] PROGMEM = "elap";
+	static PGM_P const names[MF_COUNT] PROGMEM = {
+		f_pmean, f_urms, f_irms, f_smean, f_freq, f_powerf, f_qmean, 
+		f_pangle, f_kwh, f_elap
+	};
+	// Fields in the order of the query reply
+	static const uint8_t order[MF_COUNT] PROGMEM = {
+		MF_ELAP, MF_AMPS, MF_VOLTS, MF_KW, MF_KVAR, MF_HZ, MF_PF, MF_PA, 
+		MF_KVA, MF_KWH
+	};
+	uint8_t i, f;
+	
+	JSONW_CHECK_SIZE(RECORD_JSON_MAX);
+	jsonw_begin(RECORD_JSON_MAX);
+	for(i = 0; i < MF_COUNT; i++){
+		f = pgm_read_byte(&order[i]);
+		if(fields & _BV(f))
+			jsonw_str((PGM_P) pgm_read_ptr(&names[f]), meter_str(f));
+	}
+	jsonw_end();
+}
+
+/*
+ * Send the measurement record if the stream is due.
+ * 
+ * Called after each snapshot. A record is only queued when it fits in 
+ * the transmit buffer, so the stream never blocks metering. Otherwise
+ * it is skipped, and tried again after the next snapshot.
+ */
+ 
+static void stream_service(void)
+{
+	uint8_t buf[PROTO_PAYLOAD_MAX];
+	uint8_t n;
+	
+	if(!switches.send_measurement_records || ((int64_t) (meter.ticks - stream_due) < 0))
+		return;
+	if(uart0_tx_space() < (binary_mode ? RECORD_BINARY_MAX : RECORD_JSON_MAX)){
+		stream_skipped++;
+		return;
+	}
+	
+	// Next record, keeping to the interval unless the stream fell behind
+	stream_due += timer0_ms_to_ticks(stream_interval);
+	if((int64_t) (meter.ticks - stream_due) >= 0)
+		stream_due = meter.ticks + timer0_ms_to_ticks(stream_interval);
+	
+	if(binary_mode){
+		n = 0;
+		buf[n++] = PROTO_OP_RECORD | PROTO_REPLY;
+		buf[n++] = PROTO_OK;
+		n = proto_put16(buf, n, stream_fields);
+		n = binary_record(buf, n, stream_fields);
+		proto_send(buf, n);
+		return;
+	}
+	
+	json_record(stream_fields);
+}
+
+/*
+ * Start or stop the measurement record stream
+ * 
+ * An interval of 0 stops the stream. A field mask of 0 selects all 
+ * fields.
+ */
+
+static void stream_subscribe(uint16_t interval, uint16_t fields)
+{
+	fields &= MF_ALL;
+	stream_interval = interval;
+	stream_fields = fields ? fields : MF_ALL;
+	stream_skipped = 0;
+	stream_due = meter.ticks;
+	switches.send_measurement_records = (interval) ? 1 : 0;
+}
+
+/*
+ * Perform subscribe command
+ * 
+ * "interval" sets the milliseconds between measurement records, 0 
+ * stops them. "fields" is a hex mask of the record fields: pmean, 
+ * urms, irms, smean, freq, powerf, qmean, pangle, kwh and elap from
+ * bit 0 up. It defaults to all of them. Records follow the measurement
+ * snapshots, so an interval shorter than the polling schedule sends a
+ * record after every snapshot. Without arguments, reports the stream 
+ * settings and the number of records skipped because the transmit 
+ * buffer was full.
+ */
+
+static void do_subscribe_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t tok;
+	char interval_s[7], fields_s[5];
+	char *end;
+	uint32_t interval;
+	uint16_t fields = 0;
+	
+	tok = json_key_index(line, tokens, PSTR("interval"));
+	if(tok > 0){
+		json_value(line, tokens, tok + 1, interval_s, sizeof(interval_s));
+		interval = strtoul(interval_s, &end, 10);
+		if(!interval_s[0] || *end || (interval > 0xFFFF)){
+			json_error(ERR_BADVALUE); // Bad interval
+			return;
+		}
+		tok = json_key_index(line, tokens, PSTR("fields"));
+		if(tok > 0){
+			json_value(line, tokens, tok + 1, fields_s, sizeof(fields_s));
+			if(!str2hex(&fields, fields_s)){
+				json_error(ERR_BADVALUE); // Bad field mask
+				return;
+			}
+		}
+		stream_subscribe((uint16_t) interval, fields);
+	}
+	
+	jsonw_begin(52);
+	jsonw_uint(PSTR("interval"), switches.send_measurement_records ? stream_interval : 0);
+	jsonw_hex16(PSTR("fields"), stream_fields);
+	jsonw_uint(PSTR("skipped"), stream_skipped);
+	jsonw_end();
+}
+
+/*
+ * Perform baud command
+ * 
+ * "rate" changes the baud rate to 9600, 115200, 250000, 500000 or 
+ * 1000000. The reply goes out at the old rate, then the port switches. 
+ * The host then sends "confirm" at the new rate within SERIAL_CONFIRM_MS,
+ * which saves the rate. Otherwise the meter goes back to the old rate.
+ * Double speed is used where it gives a closer rate.
+ */
+ 
+static void do_baud_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t tok;
+	char rate_s[8];
+	uint32_t rate;
+	uint8_t i;
+	
+	tok = json_key_index(line, tokens, PSTR("rate"));
+	if(tok > 0){
+		json_value(line, tokens, tok + 1, rate_s, sizeof(rate_s));
+		rate = strtoul(rate_s, NULL, 10);
+		for(i = 0; i < BAUD_RATES; i++){
+			if(pgm_read_dword(&baud_rates[i]) == rate)
+				break;
+		}
+		if(i == BAUD_RATES){
+			json_error(ERR_BADVALUE); // Unsupported rate
+			return;
+		}
+		jsonw_begin(36);
+		jsonw_uint(PSTR("baud"), rate);
+		jsonw_uint(PSTR("confirm"), SERIAL_CONFIRM_MS);
+		jsonw_end();
+		if(!baud_pending)
+			baud_fallback = baud_index;
+		baud_index = i;
+		baud_pending = TRUE;
+		timer0_future_ms(SERIAL_CONFIRM_MS, &baud_timeout);
+		uartstream_set_baud(rate);
+		return;
+	}
+	
+	if((json_key_index(line, tokens, PSTR("confirm")) > 0) && baud_pending){
+		baud_pending = FALSE;
+		baud_save();
+	}
+	
+	jsonw_begin(36);
+	jsonw_uint(PSTR("baud"), pgm_read_dword(&baud_rates[baud_index]));
+	jsonw_uint(PSTR("pending"), baud_pending);
+	jsonw_end();
+}
+
+/*
+ * Test for a writable calibration register
+ */
+ 
+static bool register_writable(uint8_t addr)
+{
+	// Status and special registers, start and checksum registers
+	// Write not implemented
+	if((addr < EM_CAL_FIRST) || (addr > EM_MEAS_LAST))
+		return FALSE;
+	if((addr > EM_CAL_LAST) && (addr < EM_MEAS_FIRST))
+		return FALSE;
+	return TRUE;
+}
+
+/*
+ * Stage a calibration register write in the calibration data and the
+ * register shadow. register_commit() sends it.
+ */
+ 
+static void register_stage(uint8_t addr, uint16_t value)
+{
+	if(addr < 0x30){			
+		// Metering calibration range
+		eecal.meter_cal[addr - EM_CAL_FIRST] = value;
+	}
+	else{
+		// Measurement calibration range
+		eecal.measure_cal[addr - EM_MEAS_FIRST] = value;
+	}
+	em_reg_write(addr, value);
+}
+
+/*
+ * Send the staged register writes to the em chip, and save the 
+ * calibration data
+ */
+ 
+static void register_commit(void)
+{
+	// Send just the changes and the new checksums to the em chip, under
+	// one unlock per calibration range
+	em_reg_flush();
+	
+	// Update EEPROM
+	eecal.cal_crc = calcCRC16(&eecal, (sizeof(eecal) - sizeof(uint16_t)));
+	eeprom_update_block(&eecal, &eecal_eemem, sizeof(eecal));
+}
+
+/*
+ * Write a calibration register, and save it in EEPROM
+ * 
+ * Returns FALSE if the register can't be written
+ */
+ 
+static bool register_write(uint8_t addr, uint16_t value)
+{
+	if(!register_writable(addr))
+		return FALSE;
+	register_stage(addr, value);
+	register_commit();
+	return TRUE;
+}
+
+/*
+ * Perform register command
+ */
+static void do_register_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t addrtok, valuetok;
+	char addr_s[3], value_s[5];
+	uint16_t addr, value;
+	
+	// Check for address 
+	
+	addrtok = json_key_index(line, tokens, PSTR("addr"));
+	if(addrtok < 1){
+		json_error(ERR_MISSING); // Address not present
+		return;
+	}
+		
+	// Extract address
+	json_value(line, tokens, addrtok + 1, addr_s, sizeof(addr_s));
+	if(!str2hex(&addr, addr_s) || (addr > 0x6F)){
+		json_error(ERR_BADVALUE); // Bad address, or out of range
+		return;
+	}
+		
+	// Get the value index if it exists
+	valuetok = json_key_index(line, tokens, PSTR("value"));
+
+	// If value specified, then it is a write
+	if(valuetok > 0){
+		// Extract value
+		json_value(line, tokens, valuetok + 1, value_s, sizeof(value_s));
+		if(!str2hex(&value, value_s)){
+			json_error(ERR_BADVALUE); // Bad value
+			return;
+		}
+		
+		if(!register_write(addr, value)){
+			json_error(ERR_READONLY);
+			return;
+		}
+	}
+	else{
+			// Read value from the register shadow or the em chip
+			value = em_reg_read(addr);
+	}
+	jsonw_begin(20);
+	jsonw_hex16(PSTR("value"), value);
+	jsonw_end();
+}
 	
-	// Parse line of text as a json object
-	json_res = jsmn_parse(&json_parser, line, strlen(line), tokens, NUM_JSON_TOKENS);
+
+/*
+ * Perform regs command
+ * 
+ * Reads "count" registers (decimal, 1 to REGS_MAX) from "addr". With 
+ * "values", 4 hex digits per register, writes them from "addr" on 
+ * instead. The registers written must be in one calibration range. 
+ * They go to the em chip under one unlock with one checksum update, and 
+ * to EEPROM in one update. Replies with the values of the registers.
+ * Reads may not cover the read to clear energy registers.
+ */
+
+static void do_regs_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t tok;
+	char addr_s[3], count_s[4];
+	const char *hex;
+	uint16_t addr, values[REGS_MAX];
+	uint8_t count = 1, len, i;
 	
-	if (json_res < 0) {
-		//printf_P(PSTR("Failed to parse JSON: %d\n"), json_res);
-		//printf_P(PSTR("Line: %s\n"), line);
+	tok = json_key_index(line, tokens, PSTR("addr"));
+	if(tok < 1){
+		json_error(ERR_MISSING); // Address not present
 		return;
 	}
-
-	// First item must be an object 
-	if (json_res < 1 || tokens[0].type != JSMN_OBJECT) {
-		//printf_P(PSTR("Object expected\n"));
+	json_value(line, tokens, tok + 1, addr_s, sizeof(addr_s));
+	if(!str2hex(&addr, addr_s)){
+		json_error(ERR_BADVALUE); // Bad address
 		return;
 	}
 	
+	tok = json_key_index(line, tokens, PSTR("values"));
+	if(tok > 0){
+		// Check every value before writing any
+		hex = line + tokens[tok + 1].start;
+		len = tokens[tok + 1].end - tokens[tok + 1].start;
+		if(!len || (len & 3) || (len > (REGS_MAX << 2))){
+			json_error(ERR_BADVALUE); // Bad length
+			return;
+		}
+		count = len >> 2;
+		for(i = 0; i < count; i++){
+			if(!register_writable(addr + i)){
+				json_error(ERR_READONLY);
+				return;
+			}
+			if(!str2hex(&values[i], hex + (i << 2))){
+				json_error(ERR_BADVALUE);
+				return;
+			}
+		}
+		for(i = 0; i < count; i++)
+			register_stage(addr + i, values[i]);
+		register_commit();
+	}
+	else{
+		tok = json_key_index(line, tokens, PSTR("count"));
+		if(tok > 0){
+			json_value(line, tokens, tok + 1, count_s, sizeof(count_s));
+			count = (uint8_t) atoi(count_s);
+			if(!count || (count > REGS_MAX)){
+				json_error(ERR_BADVALUE); // Bad count
+				return;
+			}
+		}
+		if((addr + count) > 0x70){
+			json_error(ERR_BADVALUE); // Address out of range
+			return;
+		}
+		// Reading an energy register clears it, which would lose energy
+		// the accumulator has not collected yet
+		if((addr <= EM_RTENERGY) && ((addr + count) > EM_APENERGY)){
+			json_error(ERR_BADVALUE); // Overlaps the energy registers
+			return;
+		}
+	}
+	
+	// Read back from the register shadow or the em chip
+	for(i = 0; i < count; i++)
+		values[i] = em_reg_read(addr + i);
+	JSONW_CHECK_SIZE(32 + (REGS_MAX << 2));
+	jsonw_begin(32 + (count << 2));
+	jsonw_str(PSTR("addr"), addr_s);
+	jsonw_hex_words(PSTR("values"), values, count);
+	jsonw_end();
+}
+
+/*
+ * Perform query command
+ */
+ 
+static void do_query_command(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	
+	json_record(MF_ALL);
+}
+
+/*
+ * Perform resetkwh command
+ */
+ 
+static void do_resetkwh_command(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	
+	reset_kwh();
+	jsonw_begin(16);
+	jsonw_str_P(PSTR("resetkwh"), PSTR("1"));
+	jsonw_end();
+}
+
+#ifdef EM_CF_PULSE
+/*
+ * Perform cf command, report the pulse derived power
+ */
+ 
+static void do_cf_command(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	
+	jsonw_begin(48);
+	jsonw_fixed(PSTR("power"), cf_power_dw(CF_ACTIVE), FALSE, 1);
+	jsonw_fixed(PSTR("reactive"), cf_power_dw(CF_REACTIVE), FALSE, 1);
+	jsonw_end();
+}
+#endif
+
+/*
+ * Perform diag command, report the verified transaction counters
+ */
+ 
+static void do_diag_command(const char *line, jsmntok_t *tokens)
+{
+	const em_diag_t *diag = em_get_diag();
+	
+	(void) line;
+	(void) tokens;
+	
+	jsonw_begin(56);
+	jsonw_uint(PSTR("verified"), diag->verified);
+	jsonw_uint(PSTR("retries"), diag->retries);
+	jsonw_uint(PSTR("failures"), diag->failures);
+	jsonw_end();
+}
+
+/*
+ * Perform binary command, switch to the binary protocol
+ */
+ 
+static void do_binary_command(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	
+	jsonw_begin(24);
+	jsonw_str_P(PSTR("protocol"), PSTR("binary"));
+	jsonw_end();
+	binary_mode = TRUE;
+	binary_eol = TRUE;
+}
+
+/*
+ * Perform spitune command, report the SPI timing profile
+ */
+ 
+static void do_spitune_command(const char *line, jsmntok_t *tokens)
+{
+	(void) line;
+	(void) tokens;
+	
+	jsonw_begin(32);
+	jsonw_uint(PSTR("profile"), em_get_timing());
+	jsonw_uint(PSTR("sclkkhz"), em_timing_khz(em_get_timing()));
+	jsonw_end();
+}
+
+/*
+ * JSON commands, their handlers and the argument keys they take
+ */
+
+static const char c_query[] PROGMEM = "query";
+static const char c_resetkwh[] PROGMEM = "resetkwh";
+static const char c_register[] PROGMEM = "register";
+static const char c_regs[] PROGMEM = "regs";
+#ifdef EM_CF_PULSE
+static const char c_cf[] PROGMEM = "cf";
+#endif
+static const char c_schedule[] PROGMEM = "schedule";
+static const char c_energy[] PROGMEM = "energy";
+static const char c_clock[] PROGMEM = "clock";
+static const char c_tou[] PROGMEM = "tou";
+static const char c_events[] PROGMEM = "events";
+static const char c_demand[] PROGMEM = "demand";
+#ifdef METER_STATS
+static const char c_stats[] PROGMEM = "stats";
+#endif
+static const char c_diag[] PROGMEM = "diag";
+static const char c_subscribe[] PROGMEM = "subscribe";
+static const char c_baud[] PROGMEM = "baud";
+static const char c_binary[] PROGMEM = "binary";
+static const char c_spitune[] PROGMEM = "spitune";
+
+static const char a_register[] PROGMEM = "addr,value";
+static const char a_regs[] PROGMEM = "addr,count,values";
+static const char a_schedule[] PROGMEM = "addr,period";
+static const char a_clock[] PROGMEM = "time";
+static const char a_tou[] PROGMEM = "day,from,to,rate";
+static const char a_events[] PROGMEM = "saved";
+static const char a_demand[] PROGMEM = "resetpeak";
+#ifdef METER_STATS
+static const char a_stats[] PROGMEM = "window,reset";
+#endif
+static const char a_subscribe[] PROGMEM = "interval,fields";
+static const char a_baud[] PROGMEM = "rate,confirm";
+
+#define COMMAND(name, args) {c_##name, sizeof(c_##name) - 1, do_##name##_command, args}
+
+static const dispatch_cmd_t command_table[] PROGMEM = {
+	COMMAND(query, NULL),
+	COMMAND(resetkwh, NULL),
+	COMMAND(register, a_register),
+	COMMAND(regs, a_regs),
+#ifdef EM_CF_PULSE
+	COMMAND(cf, NULL),
+#endif
+	COMMAND(schedule, a_schedule),
+	COMMAND(energy, NULL),
+	COMMAND(clock, a_clock),
+	COMMAND(tou, a_tou),
+	COMMAND(events, a_events),
+	COMMAND(demand, a_demand),
+#ifdef METER_STATS
+	COMMAND(stats, a_stats),
+#endif
+	COMMAND(diag, NULL),
+	COMMAND(subscribe, a_subscribe),
+	COMMAND(baud, a_baud),
+	COMMAND(binary, NULL),
+	COMMAND(spitune, NULL),
+};
+
+static dispatch_t commands;
+
+/*
+ * Run a parsed JSON command
+ */
+ 
+static void run_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t res;
+	dispatch_cmd_t cmd;
+	
 	// Check for command string
 	res = json_key_index(line, tokens, PSTR("command"));
 	if(res < 0){
-		//printf_P(PSTR("command not present\n"));
+		json_error(ERR_NOCOMMAND);
 		return;
 	}
-	// Extract command keyword
-	json_value(line, tokens, res + 1, command, sizeof(command));
 	
-	// Decode JSON command */
-	
-	if(!strcmp_P(command, PSTR("query"))){
-		printf_P(PSTR("{\"elap\":\"%s\",\"irms\":\"%s\",\"urms\":\"%s\",\"pmean\":\"%s\",\"qmean\":\"%s\",\"freq\":\"%s\",\"powerf\":\"%s\",\"pangle\":\"%s\",\"smean\":\"%s\",\"kwh\":\"%s\"}"),
-			elap, amps, volts, kw, kvar, hz, pf, pa, kva, kwh);
-		// Query command
+	// Look up the command keyword
+	if(!dispatch_find(&commands, line + tokens[res + 1].start, 
+	tokens[res + 1].end - tokens[res + 1].start, &cmd)){
+		json_error(ERR_UNKNOWN);
+		return;
 	}
-	if(!strcmp_P(command, PSTR("resetkwh"))){
-		reset_kwh();
-		// Query command
+	if(!dispatch_args_ok(&cmd, line, tokens, NUM_JSON_TOKENS)){
+		json_error(ERR_BADARG);
+		return;
 	}
-	if(!strcmp_P(command, PSTR("register"))){
-		do_register_command(line, tokens);
-		// Query command
+	cmd.fn(line, tokens);
+}
+
+/*
+ * Process a parsed JSON command
+ * 
+ * An "id" string or number of up to JSONW_ID_MAX characters is echoed
+ * at the start of the reply, error replies included. Ids are always echoed
+ * as strings, like every other value. Every command gets exactly one 
+ * reply, so a host can also match replies by counting them.
+ */
+ 
+static void process_command(const char *line, jsmntok_t *tokens)
+{
+	int16_t res;
+	jsmntok_t *id;
+	
+	res = json_key_index(line, tokens, PSTR("id"));
+	if(res > 0){
+		id = &tokens[res + 1];
+		if(((JSMN_STRING != id->type) && (JSMN_PRIMITIVE != id->type)) ||
+		!jsonw_set_id(line + id->start, id->end - id->start)){
+			json_error(ERR_BADID);
+			return;
+		}
 	}
+	run_command(line, tokens);
+	
+	// Unsolicited output, stream records included, has no id
+	jsonw_set_id(NULL, 0);
+}
 
-				
+
+/*
+ * Process a binary protocol request
+ */
+ 
+static void process_binary(const uint8_t *req, uint8_t len)
+{
+	uint8_t reply[PROTO_PAYLOAD_MAX];
+	uint8_t n = 0;
+	uint16_t value;
+	
+	reply[n++] = req[0] | PROTO_REPLY;
+	reply[n++] = PROTO_OK;
+	
+	switch(req[0]){
+		case PROTO_OP_QUERY:
+			n = binary_record(reply, n, MF_ALL);
+			break;
+			
+		case PROTO_OP_RESETKWH:
+			reset_kwh();
+			break;
+			
+		case PROTO_OP_REGISTER:
+			if(((2 != len) && (4 != len)) || (req[1] > 0x6F)){
+				reply[1] = PROTO_BAD_REQUEST;
+				break;
+			}
+			if(4 == len){
+				value = req[2] | ((uint16_t) req[3] << 8);
+				if(!register_write(req[1], value)){
+					reply[1] = PROTO_BAD_REQUEST;
+					break;
+				}
+			}
+			else
+				value = em_reg_read(req[1]);
+			reply[n++] = req[1];
+			n = proto_put16(reply, n, value);
+			break;
+			
+		case PROTO_OP_JSON:
+			binary_mode = FALSE;
+			json_queued = json_rx_pos = 0;
+			break;
+			
+		case PROTO_OP_SUBSCRIBE:
+			if(5 != len){
+				reply[1] = PROTO_BAD_REQUEST;
+				break;
+			}
+			stream_subscribe(req[1] | ((uint16_t) req[2] << 8), req[3] | ((uint16_t) req[4] << 8));
+			n = proto_put16(reply, n, stream_interval);
+			n = proto_put16(reply, n, stream_fields);
+			break;
+			
+		default:
+			reply[1] = PROTO_BAD_OPCODE;
+			break;
+	}
+	proto_send(reply, n);
 }
 
+/*
+ * Queue an error reply in place of the command being received
+ * 
+ * Returns FALSE, and keeps the error, if the queue has no room for it
+ */
+ 
+static bool json_queue_error(uint8_t error)
+{
+	json_rx_pos = json_queued;
+	if(json_queued > (sizeof(serial_buf) - 2)){
+		json_rx_error = error + 1;
+		return FALSE;
+	}
+	serial_buf[json_queued++] = error + 1;
+	serial_buf[json_queued++] = 0;
+	json_rx_pos = json_queued;
+	json_rx_error = 0;
+	return TRUE;
+}
 
 /*
- * Build a command line from incoming characters
+ * Add a character to the JSON command being received.
+ * 
+ * Whitespace outside strings isn't stored, so JSON_COMMAND_MAX limits 
+ * the JSON content rather than the line length. Anything before the 
+ * opening brace is ignored. The command is queued when the brace which
+ * opened it is closed. A command which is too long gets an error reply,
+ * and the rest of its line is discarded. So does a command which loses
+ * characters on receive, flagged by a receive error in the high byte 
+ * of s.
+ * 
+ * Returns FALSE, leaving the character unused, when the queue is full. 
+ * It is taken once the commands ahead of it have run.
  */
  
+static bool json_receive(uint16_t s)
+{
+	static uint8_t depth;
+	static bool in_string, escaped, discard;
+	char c = (char) s;
+	
+	// Leave room for the terminator
+	if(json_rx_pos >= (sizeof(serial_buf) - 1))
+		return FALSE;
+	if(json_rx_error && !json_queue_error(json_rx_error - 1))
+		return FALSE;
+	
+	// The error stays set until a character arrives without one, so 
+	// only the first character with it gets a reply
+	if((s > 0xFF) && !discard){
+		json_queue_error(ERR_OVERRUN);
+		discard = TRUE;
+	}
+	
+	if(discard){
+		if(('\r' == c) || ('\n' == c))
+			discard = FALSE;
+		return TRUE;
+	}
+	
+	if(json_rx_pos == json_queued){
+		// Wait for the start of an object
+		if('{' != c)
+			return TRUE;
+		depth = 0;
+		in_string = escaped = FALSE;
+	}
+	
+	if(in_string){
+		if(escaped)
+			escaped = FALSE;
+		else if('\\' == c)
+			escaped = TRUE;
+		else if('"' == c)
+			in_string = FALSE;
+	}
+	else if('"' == c)
+		in_string = TRUE;
+	else if((' ' == c) || ('\t' == c) || ('\r' == c) || ('\n' == c))
+		return TRUE;
+	else if('{' == c)
+		depth++;
+	else if('}' == c)
+		depth--;
+	
+	if((json_rx_pos - json_queued) >= JSON_COMMAND_MAX){
+		json_queue_error(ERR_TOOLONG);
+		discard = TRUE;
+		return TRUE;
+	}
+	serial_buf[json_rx_pos++] = c;
+	
+	// Queue the command when its object closes
+	if(!in_string && !depth){
+		serial_buf[json_rx_pos++] = 0;
+		json_queued = json_rx_pos;
+	}
+	return TRUE;
+}
 
+/*
+ * Move the JSON characters received into the command queue. Cheap 
+ * enough to call while the display redraws.
+ */
+ 
+static void json_service_receive(void)
+{
+	uint16_t s;
+	
+	while(!binary_mode && ((s = uart0_peek()) != UART_NO_DATA) && json_receive(s))
+		uart0_getc();
+}
 
-static void serial_service(void)
+/*
+ * Run the JSON command at the head of the queue, if there is one
+ */
+ 
+static void json_run(void)
 {
+	char *line = (char *) serial_buf;
+	static jsmntok_t tokens[NUM_JSON_TOKENS];
+	jsmn_parser parser;
+	jsmnerr_t res;
+	uint8_t len;
+	
+	if(!json_queued)
+		return;
+	len = strlen(line);
+	if('{' != line[0])
+		json_error(line[0] - 1);
+	else{
+		// Unused tokens must not look like keys left over from the last
+		// command
+		jsmn_init(&parser);
+		memset(tokens, 0, sizeof(tokens));
+		res = jsmn_parse(&parser, line, len, tokens, NUM_JSON_TOKENS);
+		if(res < 0)
+			json_error((JSMN_ERROR_NOMEM == res) ? ERR_TOOMANY : ERR_SYNTAX);
+		else
+			process_command(line, tokens);
+	}
+	
+	// Binary mode takes over the buffer, and drops the rest of the queue
+	if(binary_mode){
+		json_queued = json_rx_pos = 0;
+		return;
+	}
+	len++;
+	memmove(serial_buf, serial_buf + len, json_rx_pos - len);
+	json_queued -= len;
+	json_rx_pos -= len;
+}
 
-	static char line[64];
-	static uint8_t lpos = 0;
+/*
+ * Handle the characters received on the serial port
+ */
+ 
+static void serial_service(void)
+{
+	static uint8_t fpos = 0;
 	uint16_t s;
+	uint8_t len;
 	char c;
 	
-	s = uart0_peek();
-	if(s == UART_NO_DATA)
-		return; // Nothing to do...
-	if(s > 0xFF){
-		uart0_getc(); // Discard the error
+	if(!binary_mode){
+		// Receive, and run one queued command per pass
+		json_service_receive();
+		json_run();
 		return;
 	}
-	c = (char) uart0_getc();
-	
-	if(('\r' == c) || ('\n' == c)){
-		if(lpos){
-			line[lpos] = 0;
-			lpos = 0;
-			process_command(line);
 	
+	for(;;){
+		if(!binary_mode)
+			return; // Switched back to JSON
+		s = uart0_getc();
+		if(s == UART_NO_DATA)
+			return; // Nothing to do...
+		
+		if(s > 0xFF)
+			continue; // Discard the error
+		c = (char) s;
+		
+		// The binary command's line end isn't part of the first frame
+		if(binary_eol && (('\r' == c) || ('\n' == c)))
+			continue;
+		binary_eol = FALSE;
+		
+		// Collect a frame up to the zero delimiter. Overlong frames are
+		// dropped.
+		if(c){
+			if(fpos < sizeof(serial_buf))
+				serial_buf[fpos] = c;
+			if(fpos < 0xFF)
+				fpos++;
+		}
+		else{
+			if((fpos <= sizeof(serial_buf)) && (len = proto_decode(serial_buf, fpos)))
+				process_binary(serial_buf, len);
+			fpos = 0;
 		}
-	}
-	else if(lpos < sizeof(line)){
-		line[lpos] = c;
-		lpos++;
 	}
 }
 
@@ -740,7 +2373,7 @@ static void serial_service(void)
 void check_buttons(void)
 {
 	uint8_t id, event;
-	uint8_t show_data = ((dispmode >= DISPMODE_KVA) && (dispmode <= DISPMODE_VRMS));
+	uint8_t show_data = ((dispmode >= DISPMODE_KVA) && (dispmode <= DISPMODE_STATS));
 	
 	if(button_get_event(&id, &event)){
 		// If displaying data
@@ -763,6 +2396,12 @@ void check_buttons(void)
 						break;
 						
 					case DISPMODE_VRMS:
+#ifdef METER_STATS
+						dispmode = DISPMODE_STATS;
+						break;
+						
+					case DISPMODE_STATS:
+#endif
 						dispmode = DISPMODE_KW;
 						break;
 																
@@ -772,6 +2411,14 @@ void check_buttons(void)
 						
 				}
 			}
+#ifdef METER_STATS
+			// Button #2 selects the statistics window
+			if((id == 2) && (event == BUTTON_EVENT_RELEASED) && (dispmode == DISPMODE_STATS)){
+				clear_screen();
+				if(++stats_window >= STATS_WINDOWS)
+					stats_window = STATS_WIN0;
+			}
+#endif
 			if((id == 3) && (event == BUTTON_EVENT_RELEASED)){ /* Menu */
 				// Clear screen 
 				clear_screen();
@@ -797,7 +2444,12 @@ void check_buttons(void)
 								if(menu_selected(&main_menu) == 0){
 									reset_kwh();
 								}
-								// Lack of break deliberate
+#ifdef METER_STATS
+								else if(menu_selected(&main_menu) == 1){
+									stats_reset();
+								}
+#endif
+								// Fall through - lack of break deliberate
 									
 							case 3: // Exit
 								clear_screen();
@@ -817,12 +2469,23 @@ void check_buttons(void)
 	}
 }
 
+/*
+ * Gather measurement data
+ * 
+ * The registers are read as a snapshot by the em transaction engine in 
+ * the background. Each snapshot reads the registers which are due 
+ * according to the polling schedule. Results are processed when the 
+ * snapshot completes.
+ */
+
 void gather_data(void)
 {
 
 
-	uint32_t calc_kwh;
-	int16_t kvai;
+	meter_record_t rec;
+	uint32_t units;
+	uint16_t due;
+	uint8_t i, j;
 
 	
 			
@@ -834,68 +2497,88 @@ void gather_data(void)
 		case DISPMODE_KVA:
 		case DISPMODE_ARMS:
 		case DISPMODE_VRMS:
+		case DISPMODE_STATS:
 		
-		
-			// Get data
-			// kW
-			twos_compl_to_fixed_decimal_int16(kw,8,3, 
-				(int16_t) em_read_transaction(EM_PMEAN));
-
-			// Vrms
-			to_fixed_decimal_uint16(volts, 8, 2,
-				em_read_transaction(EM_URMS));
-
-			// Irms
-			to_fixed_decimal_uint16(amps, 8, 3,
-				em_read_transaction(EM_IRMS));
-
-			// Apparent power (kVA)
-			kvai = (int16_t) em_read_transaction(EM_SMEAN);
-			twos_compl_to_fixed_decimal_int16(kva,8,3, kvai);
-
-			// Line frequency
-			to_fixed_decimal_uint16(hz, 8, 2, 
-				em_read_transaction(EM_FREQ));
+#ifdef METER_STATS
+			// Close the statistics windows which are due
+			stats_service();
+#endif
+
+			// Close the demand sub-interval when due, save a new peak
+			if(demand_service())
+				demand_save();
+			
+			// Still waiting for the chip?
+			if(EM_BATCH_QUEUED == meas_batch.state)
+				break;
 				
-			// KWH
-			uint16_t fae =  em_read_transaction(EM_APENERGY);
+			if(EM_BATCH_DONE == meas_batch.state){
 			
-			// Add what was read to the total.
-			fae_total += fae;
-		
-			// KWH is equivalent to  fae_total divided by MC integer pulses 
-			// Since the fractional pulses are included in fae_total,
-			// we need to account for them.  We do this by multiplying
-			// by 1000 so that we get a kwh number which can be represented
-			// with 4 decimal digits.
-			//
-			calc_kwh = ((fae_total * 1000L)/ MC);
-			sprintf_P(kwh, PSTR("%03d.%04d"),((uint16_t) calc_kwh / 10000), ((uint16_t) calc_kwh % 10000));
-		
-
-
-			// For Power Factor, kVAR and Phase angle:
-			// Only display these if there is apparent power
-			if(kvai){
-				// Power Factor
-				ones_compl_to_fixed_decimal_int16(pf, 8, 3,
-				em_read_transaction(EM_POWERF));
-				// Reactive power (kVA)
-				twos_compl_to_fixed_decimal_int16(kvar, 8, 3,
-				em_read_transaction(EM_QMEAN));
-				// Phase angle
-				ones_compl_to_fixed_decimal_int16(pa, 8, 1, 
-				em_read_transaction(EM_PANGLE));
-			}
-			else{
-				// Display double dash when above are invalid
-				set_doubledash(kvar);
-				set_doubledash(pf);
-				set_doubledash(pa);
+				// Update the measurement record. Registers which were not
+				// part of this snapshot keep their last values. Related
+				// registers are always read together, so they agree.
+				rec.pmean = (int16_t) meas.pmean;
+				rec.urms = meas.urms;
+				rec.irms = meas.irms;
+				rec.smean = (int16_t) meas.smean;
+				rec.freq = meas.freq;
+				rec.powerf = meas.powerf;
+				rec.qmean = (int16_t) meas.qmean;
+				rec.pangle = meas.pangle;
+				rec.ticks = meas_batch.ticks;
+					
+#ifdef EM_CF_PULSE
+				// Pulse derived power is only used at low load
+				rec.cf_dw = (abs(rec.pmean) < CF_LOW_LOAD_W) ? cf_power_dw(CF_ACTIVE) : 0;
+#endif
+					
+				// Energy. The energy registers clear when they are read, 
+				// so only add the ones which were part of this snapshot.
+				for(i = 0; i < ENERGY_REGS; i++){
+					j = pgm_read_byte(&energy_meas[i]);
+					units = (meas_batch.mask & _BV(j)) ? ((uint16_t *) &meas)[j] : 0;
+#ifdef EM_CF_PULSE
+					// Each CF1 pulse is 10 tenths of a pulse
+					if(ENERGY_IMPORT == i)
+						units = cf_take_pulses(CF_ACTIVE) * 10UL;
+#endif
+					energy_add(&energy[i], units);
+					if(ENERGY_IMPORT == i){
+						demand_add(units);
+						energy_add(&energy[ENERGY_TOU + tou_rate()], units);
+					}
+					if((ENERGY_IMPORT == i) || (ENERGY_EXPORT == i))
+						energy_unsaved += units;
+				}
+				
+				// Save the energy totals every ENERGY_SAVE_WH
+				if(energy_unsaved >= ENERGY_SAVE_DELTA)
+					energy_save();
+			
+				rec.kwh = energy[ENERGY_IMPORT];
+				
+				meter_update(&rec);
+				stream_service();
+				
+				// Power quality events
+				if(meas_batch.mask & (_BV(MEAS_URMS) | _BV(MEAS_SYSSTATUS)))
+					events_voltage(rec.urms, (meas.sysstatus & EM_SYSSTATUS_SAGWARN) ? TRUE : FALSE, rec.ticks);
+				if(meas_batch.mask & _BV(MEAS_IRMS))
+					events_current(rec.irms, rec.ticks);
+				
+#ifdef METER_STATS
+				stats_feed(&rec, meas_batch.mask);
+#endif
+				
+				// Processed
+				meas_batch.state = EM_BATCH_IDLE;
 			}
 			
-	
-		  	timer0_elapsed_time(elap, 32);
+			// Start a snapshot of the registers which are due
+			due = schedule_due();
+			if(due)
+				em_read_snapshot(&meas_batch, meas_reglist, MEAS_COUNT, (uint16_t *) &meas, due);
+			break;
 		
 		default:
 			break;
@@ -926,14 +2609,22 @@ static void update_display(void)
 			case DISPMODE_KVA:
 			case DISPMODE_VRMS:
 			case DISPMODE_ARMS:
-				draw_meter_data(volts, amps, kw, kva, hz, pf, 
-					kvar, pa, kwh);
+				draw_meter_data();
+				break;
+				
+#ifdef METER_STATS
+			case DISPMODE_STATS:
+				draw_stats();
 				break;
+#endif
 	
 	
 			default:
 				break;
 		}
+		
+		// Keep queueing commands while the display redraws
+		json_service_receive();
 						
 	} while ( u8g_NextPage(&u8g) );
 }
@@ -948,11 +2639,13 @@ static void update_display(void)
 int main(void)
 {
 	uint16_t res;
-	uint16_t cs;
 	static uint64_t timer;
 	
 	
 	init();
+	
+	// Build the JSON command lookup
+	dispatch_init(&commands, command_table, sizeof(command_table) / sizeof(command_table[0]));
  
   
     // Set splash time;
@@ -960,9 +2653,9 @@ int main(void)
     
     // Per Atmel app note AN-643, change the Temperature coefficient from 0x8077 to 0x8097
     _delay_us(20000);
-	em_write_transaction(EM_CALSTART, 0x9779);
-	em_write_transaction(EM_TCOEFF_ADJ, 0x8097);
-	em_write_transaction(EM_CALSTART, 0x8765);
+	em_write_verified(EM_CALSTART, 0x9779);
+	em_write_verified(EM_TCOEFF_ADJ, 0x8097);
+	em_write_verified(EM_CALSTART, 0x8765);
 	_delay_us(100000);
     
     eeprom_read_block(&eecal, &eecal_eemem, sizeof(eecal)); 
@@ -972,7 +2665,9 @@ int main(void)
     // Check state of calibration portion of EEPROM
     
 	if((0x55AA != eecal.sig) || (res != eecal.cal_crc)){ // BAD signature or bad CRC in EEPROM
-		printf_P(PSTR("{\"eepromdefaulted\":\"1\"}\n"));
+		jsonw_begin(24);
+		jsonw_str_P(PSTR("eepromdefaulted"), PSTR("1"));
+		jsonw_end();
 		// Read the defaults from the chip
 		eecal.sig = 0x55AA;
 		em_read_block(EM_PLCONSTH, EM_MMODE, eecal.meter_cal);
@@ -987,7 +2682,9 @@ int main(void)
 	    // Write data back out to EEPROM
 
 		eecal.cal_crc = calcCRC16(&eecal, (sizeof(eecal) - sizeof(uint16_t)));
-		printf("{\"eepromcrc\":\"%04X\"}\n", eecal.cal_crc);
+		jsonw_begin(20);
+		jsonw_hex16(PSTR("eepromcrc"), eecal.cal_crc);
+		jsonw_end();
 		eeprom_update_block(&eecal, &eecal_eemem, sizeof(eecal));
 
 	}	
@@ -1000,36 +2697,60 @@ int main(void)
 	menu_add_button(&main_menu, &bt_right, bl_exit, 3, 56, 100);
 	
  
-    //Enter meter calibration
-	em_write_transaction(EM_CALSTART, 0x5678);
 	// Override the power line constant
 	eecal.meter_cal[PLCONSTL] = (uint16_t) PLC;
 	eecal.meter_cal[PLCONSTH] = (uint16_t) (PLC >> 16);
 	// Override the mode word
 	eecal.meter_cal[MMODE] = MODE_WORD;
-    // Write out the meter cal values
-    cs = em_write_block(EM_PLCONSTH, EM_MMODE, eecal.meter_cal);
-    // Write CS1 checksum
-    em_write_transaction(EM_CS1, cs);
-    // Exit meter calibration
-    em_write_transaction(EM_CALSTART, 0x8765); 
+	// Write out the meter cal values and the CS1 checksum
+	em_reg_write_block(EM_PLCONSTH, EM_MMODE, eecal.meter_cal);
+	em_reg_flush();
     timer0_delay_ms(100);
     // Send meter status
-    printf_P(PSTR("{\"calinit\":\"%04X\"}\n"), em_read_transaction(EM_SYSSTATUS));
-	
-	// Enter measurement calibration
-	em_write_transaction(EM_ADJSTART, 0x5678);
-	// Write out the measurement calibration values
-	cs = em_write_block(EM_UGAIN, EM_QOFFSETN, eecal.measure_cal);
-	// Write the CS2 checksum
-	em_write_transaction(EM_CS2, cs);
-	// Exit measurement calibration
-	em_write_transaction(EM_ADJSTART, 0x8765);
+	jsonw_begin(20);
+	jsonw_hex16(PSTR("calinit"), em_read_transaction(EM_SYSSTATUS));
+	jsonw_end();
+	
+	// Write out the measurement calibration values and the CS2 checksum
+	em_reg_write_block(EM_UGAIN, EM_QOFFSETN, eecal.measure_cal);
+	em_reg_flush();
 	timer0_delay_ms(100);
 
 	
 	// Send meter status
-	printf_P(PSTR("{\"measinit\":\"%04X\"}\n"), em_read_transaction(EM_SYSSTATUS));
+	jsonw_begin(20);
+	jsonw_hex16(PSTR("measinit"), em_read_transaction(EM_SYSSTATUS));
+	jsonw_end();
+	
+	// Have the chip watch for voltage sags
+	em_reg_write(EM_SAGTH, events_sagth(eecal.measure_cal[UGAIN]));
+	em_reg_write(EM_FUNCEN, em_reg_read(EM_FUNCEN) | EM_FUNCEN_SAGEN);
+	em_reg_flush();
+	events_init();
+	
+	// Speed up the em chip SPI as far as the wiring allows
+	tune_spi();
+	
+	// Load the measurement polling schedule
+	schedule_init();
+	
+	// Load the peak demand
+	demand_load();
+	
+	// Load the time of use schedule
+	tou_init();
+	
+	// Restore the energy totals
+	energy_load();
+	
+#ifdef POWERFAIL_WARN
+	powerfail_init();
+#endif
+	
+#ifdef METER_STATS
+	// Start the statistics windows
+	stats_reset();
+#endif
 	
 
 
@@ -1046,7 +2767,14 @@ int main(void)
 			clear_screen();
 		}
 	 
+#ifdef POWERFAIL_WARN
+		// Save the energy totals while there is still power
+		if(powerfail_pending() && energy_unsaved)
+			energy_save();
+#endif
+	 
 		check_buttons();
+		baud_service();
 		serial_service();
 		gather_data();
 		
@@ -88,7 +88,7 @@ void menu_draw(menu_t *menu, u8g_t *u8g)
 	w = u8g_GetWidth(u8g);
 	for( i = 0;; i++ ) {        // draw all menu items
 		// Copy string from program memory to a work string in RAM
-		strncpy_P(ramstr, (PGM_P)pgm_read_word(&(menu->strings[i])), sizeof(ramstr));
+		strncpy_P(ramstr, (PGM_P)pgm_read_ptr(&(menu->strings[i])), sizeof(ramstr));
 		ramstr[31] = 0;
 		// Zero length string marks end of string list. 
 		if(!ramstr[0])
@@ -152,11 +152,9 @@ uint8_t menu_update_required(menu_t *menu)
 
 void menu_next(menu_t *menu)
 {
-	printf("selected = %d\n", menu->selected);
 	menu->selected++;
 	if(menu->selected >= menu->item_count)
 		menu->selected = 0;
-	printf("new selected = %d\n", menu->selected);
 	menu->dirty = TRUE;
 }
 
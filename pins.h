@@ -18,7 +18,27 @@
  
  
  /*
-  * Energy monitoring chip software SPI ports and pins
+  * Hardware SPI port and pins (shared by the display and the em chip)
+  */
+ 
+ #define SPI_DDR		DDRB
+ #define SPI_SS_PIN		2
+ #define SPI_MOSI_PIN		3
+ #define SPI_MISO_PIN		4
+ #define SPI_SCK_PIN		5
+ 
+ /*
+  * Energy monitoring chip chip select (hardware SPI backend, active low)
+  * 
+  * This is the SS pin, which has to be an output for SPI master mode anyway.
+  */
+ 
+ #define EM_CS_DDR		DDRB
+ #define EM_CS_PORT		PORTB
+ #define EM_CS_PIN		SPI_SS_PIN
+ 
+ /*
+  * Energy monitoring chip software SPI ports and pins (EM_SPI_SOFT backend)
   */
  
  #define EM_SCLK_DDR		DDRD
@@ -33,6 +53,34 @@
  #define EM_MOSI_PORT		PORTD
  #define EM_MOSI_PIN		3
  
+ /*
+  * CF pulse inputs (EM_CF_PULSE)
+  * 
+  * CF1 (active energy) must be on the Timer1 input capture pin ICP1.
+  * CF2 (reactive energy) uses a PORTC pin change interrupt.
+  */
+ 
+ #define CF1_DDR		DDRB
+ #define CF1_PIN		0
+ 
+ #define CF2_DDR		DDRC
+ #define CF2_PINPORT		PINC
+ #define CF2_PIN		0
+ #define CF2_PCMSK		PCMSK1
+ #define CF2_PCINT		PCINT8
+ 
+ /*
+  * Power fail warning input (POWERFAIL_WARN)
+  * 
+  * The divided down unregulated supply, on an ADC input to reach the 
+  * analog comparator through the ADC multiplexer.
+  */
+ 
+ #define PF_DDR		DDRC
+ #define PF_PIN		1
+ #define PF_ADC_MUX		1
+ #define PF_DIDR		ADC1D
+ 
  /*
   * Button port and pins
   */
@@ -0,0 +1,88 @@
+//
+//		powerfail.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Early power fail warning
+ *
+ * The analog comparator compares the bandgap reference with the 
+ * unregulated supply, divided down to about 1.5V and wired to an ADC 
+ * input (see pins.h). The comparator input pins themselves are taken by 
+ * the buttons. When the supply falls, the comparator interrupts, which 
+ * leaves the hold up time of the regulator to save what needs saving.
+ */
+
+#include "includes.h"
+
+#ifdef POWERFAIL_WARN
+
+static volatile bool powerfail_flag;
+
+/*
+ * Comparator interrupt, the supply is falling
+ */
+
+ISR(ANALOG_COMP_vect)
+{
+	powerfail_flag = TRUE;
+}
+
+/*
+ * Set up the comparator
+ */
+ 
+void powerfail_init(void)
+{
+	// Analog input, digital input buffer off
+	PF_DDR &= ~_BV(PF_PIN);
+	DIDR0 |= _BV(PF_DIDR);
+	
+	// Negative input from the ADC multiplexer, which needs the ADC off
+	ADCSRA &= ~_BV(ADEN);
+	ADMUX = (ADMUX & 0xF0) | PF_ADC_MUX;
+	ADCSRB |= _BV(ACME);
+	
+	// Bandgap on the positive input. The output rises when the divided
+	// supply falls below the bandgap.
+	ACSR = _BV(ACBG) | _BV(ACIS1) | _BV(ACIS0);
+	
+	// Let the bandgap settle, then discard any edge from switching inputs
+	_delay_us(100);
+	ACSR |= _BV(ACI);
+	ACSR |= _BV(ACIE);
+}
+
+/*
+ * Return TRUE once after a power fail warning
+ */
+ 
+bool powerfail_pending(void)
+{
+	bool res;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		res = powerfail_flag;
+		powerfail_flag = FALSE;
+	}
+	return res;
+}
+
+#endif
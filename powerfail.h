@@ -0,0 +1,9 @@
+#ifndef POWERFAIL_H
+#define POWERFAIL_H
+
+// Methods
+
+void powerfail_init(void);
+bool powerfail_pending(void);
+
+#endif
@@ -0,0 +1,124 @@
+//
+//		proto.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Binary protocol framing
+ *
+ * COBS (consistent overhead byte stuffing) replaces the zero bytes in a
+ * frame, so a zero byte can mark the end of each frame. Each block 
+ * starts with a code byte: one more than the number of data bytes which
+ * follow it. A code below 0xFF means a zero follows the block, unless it
+ * is the last block. See proto.h for the frame and payload layout.
+ */
+
+#include "includes.h"
+
+/*
+ * Decode a received frame in place, without the delimiter, and check 
+ * its CRC.
+ * 
+ * Returns the payload length, 0 if the frame is bad
+ */
+ 
+uint8_t proto_decode(uint8_t *frame, uint8_t len)
+{
+	uint8_t in = 0, out = 0;
+	uint8_t code, i;
+	
+	while(in < len){
+		code = frame[in++];
+		if(!code)
+			return 0;
+		for(i = 1; i < code; i++){
+			if(in >= len)
+				return 0; // Block runs past the end
+			frame[out++] = frame[in++];
+		}
+		if((code < 0xFF) && (in < len))
+			frame[out++] = 0;
+	}
+	
+	// Opcode and CRC at least
+	if(out < 3)
+		return 0;
+	out -= 2;
+	if(calcCRC16(frame, out) != (((uint16_t) frame[out] << 8) | frame[out + 1]))
+		return 0;
+	return out;
+}
+
+/*
+ * Return a byte of the payload followed by its CRC
+ */
+ 
+static uint8_t proto_byte(const uint8_t *payload, uint8_t len, uint16_t crc, uint8_t i)
+{
+	if(i < len)
+		return payload[i];
+	return (i == len) ? (uint8_t) (crc >> 8) : (uint8_t) crc;
+}
+
+/*
+ * Send a payload as a frame
+ */
+ 
+void proto_send(const uint8_t *payload, uint8_t len)
+{
+	uint16_t crc = calcCRC16(payload, len);
+	uint8_t total = len + 2;
+	uint8_t start = 0, end, i;
+	
+	for(;;){
+		// A block ends at a zero, the end of the frame, or 254 bytes
+		for(end = start; (end < total) && ((end - start) < 0xFE) && 
+		proto_byte(payload, len, crc, end); end++);
+		uart0_putc(end - start + 1);
+		for(i = start; i < end; i++)
+			uart0_putc(proto_byte(payload, len, crc, i));
+		if(end >= total)
+			break;
+		// Skip the zero, unless the block ended for length
+		start = ((end - start) == 0xFE) ? end : end + 1;
+	}
+	uart0_putc(0);
+}
+
+/*
+ * Put a 16 bit value in a payload, return the next position
+ */
+ 
+uint8_t proto_put16(uint8_t *buf, uint8_t pos, uint16_t value)
+{
+	buf[pos++] = (uint8_t) value;
+	buf[pos++] = (uint8_t) (value >> 8);
+	return pos;
+}
+
+/*
+ * Put a 32 bit value in a payload, return the next position
+ */
+ 
+uint8_t proto_put32(uint8_t *buf, uint8_t pos, uint32_t value)
+{
+	pos = proto_put16(buf, pos, (uint16_t) value);
+	return proto_put16(buf, pos, (uint16_t) (value >> 16));
+}
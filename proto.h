@@ -0,0 +1,58 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+/*
+ * Binary protocol
+ * 
+ * Requests and replies are frames: the payload, then the CRC16 of the 
+ * payload high byte first, COBS encoded and ended by a zero byte. The
+ * first payload byte is the opcode. A reply has the request opcode with
+ * PROTO_REPLY set, then a status byte, then the reply data. Multi-byte
+ * values are little endian. Line end characters straight after the JSON
+ * binary command are ignored, and a zero byte before a frame is allowed.
+ * 
+ * PROTO_OP_QUERY      request: nothing
+ *                     reply: ticks (4, timer0 ticks of 1.024ms), PMEAN,
+ *                     URMS, IRMS, SMEAN, FREQ, POWERF, QMEAN, PANGLE (2 
+ *                     each, raw register values), import energy whole 
+ *                     kWh (4), and remainder (2, 0.1 CF pulses)
+ * PROTO_OP_RESETKWH   request: nothing, reply: nothing
+ * PROTO_OP_REGISTER   request: address (1), and value (2) for a write
+ *                     reply: address (1), value (2)
+ * PROTO_OP_JSON       request: nothing, reply: nothing. Switches back to
+ *                     the JSON protocol after the reply.
+ * PROTO_OP_SUBSCRIBE  request: interval (2, ms, 0 to stop), and field mask 
+ *                     (2, bits numbered as the JSON subscribe fields)
+ *                     reply: interval (2), field mask (2)
+ * PROTO_OP_RECORD     sent unrequested with PROTO_REPLY set while 
+ *                     subscribed: field mask (2), then the fields in the
+ *                     mask, in the PROTO_OP_QUERY layout.
+ */
+
+// Largest payload
+
+#define PROTO_PAYLOAD_MAX 48
+
+// Largest encoded frame, without the delimiter
+
+#define PROTO_FRAME_MAX (PROTO_PAYLOAD_MAX + 4)
+
+// Opcodes
+
+enum {PROTO_OP_QUERY = 0x01, PROTO_OP_RESETKWH, PROTO_OP_REGISTER, PROTO_OP_JSON,
+	PROTO_OP_SUBSCRIBE, PROTO_OP_RECORD};
+
+#define PROTO_REPLY 0x80
+
+// Reply status
+
+enum {PROTO_OK = 0, PROTO_BAD_OPCODE, PROTO_BAD_REQUEST};
+
+// Methods
+
+uint8_t proto_decode(uint8_t *frame, uint8_t len);
+void proto_send(const uint8_t *payload, uint8_t len);
+uint8_t proto_put16(uint8_t *buf, uint8_t pos, uint16_t value);
+uint8_t proto_put32(uint8_t *buf, uint8_t pos, uint32_t value);
+
+#endif
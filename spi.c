@@ -0,0 +1,169 @@
+//
+//		spi.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//
+//
+
+/*
+ * Hardware SPI bus manager
+ *
+ * Several devices share the SPI peripheral. Each device has its own
+ * SPI mode, clock rate and chip select. A device must own the bus before
+ * it can use it. Acquiring the bus loads the device's SPCR and SPSR values,
+ * so devices with different clock rates can be mixed freely.
+ */
+
+#include "includes.h"
+
+// Display SPI settings: mode 3, fclk/16 (1MHz) to meet ST7920 timing.
+// Chip select is handled by u8glib.
+
+static const spi_device_t spi_display = {
+	.spcr = (_BV(SPE) | _BV(MSTR) | _BV(SPR0) | _BV(CPOL) | _BV(CPHA)),
+	.spsr = 0,
+	.cs_port = NULL,
+};
+
+// Current bus owner, NULL if the bus is free
+
+static const spi_device_t * volatile spi_owner = NULL;
+
+// Display device which arbitrates for the bus
+// (device function lives in u8g_dev_st7920_128x64.c)
+
+uint8_t u8g_dev_st7920_128x64_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, void *arg);
+
+U8G_PB_DEV(u8g_dev_st7920_128x64_shared_spi, 128, 64, 8, u8g_dev_st7920_128x64_fn, u8g_com_st7920_shared_spi_fn);
+
+/*
+ * Initialize the SPI peripheral as a bus master
+ */
+
+void spi_init(void)
+{
+	// SCK, MOSI and SS are outputs, MISO is an input.
+	// SS must stay an output for the peripheral to remain in master mode.
+	SPI_DDR |= (_BV(SPI_SCK_PIN) | _BV(SPI_MOSI_PIN) | _BV(SPI_SS_PIN));
+	SPI_DDR &= ~_BV(SPI_MISO_PIN);
+	SPCR = spi_display.spcr;
+	SPSR = spi_display.spsr;
+}
+
+/*
+ * Add a device to the bus.
+ *
+ * Configures the chip select pin as an output and deasserts it
+ */
+
+void spi_add_device(const spi_device_t *dev, volatile uint8_t *cs_ddr)
+{
+	if(!dev || !dev->cs_port)
+		return;
+	spi_select(dev, FALSE);
+	*cs_ddr |= dev->cs_mask;
+}
+
+/*
+ * Try to acquire the bus for a device.
+ *
+ * Returns TRUE if the device now owns the bus, FALSE if the bus is
+ * already owned. Safe to call from interrupt context.
+ */
+
+bool spi_try_acquire(const spi_device_t *dev)
+{
+	bool res = FALSE;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(!spi_owner){
+			spi_owner = dev;
+			SPCR = dev->spcr;
+			SPSR = dev->spsr;
+			res = TRUE;
+		}
+	}
+	return res;
+}
+
+/*
+ * Acquire the bus for a device, wait until it is free
+ */
+
+void spi_acquire(const spi_device_t *dev)
+{
+	while(FALSE == spi_try_acquire(dev));
+}
+
+/*
+ * Release the bus
+ */
+
+void spi_release(const spi_device_t *dev)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(spi_owner == dev)
+			spi_owner = NULL;
+	}
+}
+
+/*
+ * Assert or deassert a device's chip select
+ */
+
+void spi_select(const spi_device_t *dev, bool state)
+{
+	if(!dev->cs_port)
+		return;
+	if(state == dev->cs_active_high)
+		*dev->cs_port |= dev->cs_mask;
+	else
+		*dev->cs_port &= ~dev->cs_mask;
+}
+
+/*
+ * Do a full duplex byte transfer. Caller must own the bus.
+ */
+
+uint8_t spi_transfer(uint8_t out_byte)
+{
+	SPDR = out_byte;
+	while(!(SPSR & _BV(SPIF)));
+	return SPDR;
+}
+
+/*
+ * u8glib com function for the display on the shared bus.
+ *
+ * The display owns the bus while its chip select is asserted.
+ */
+
+uint8_t u8g_com_st7920_shared_spi_fn(u8g_t *u8g, uint8_t msg, uint8_t arg_val, void *arg_ptr)
+{
+	uint8_t res;
+
+	if((U8G_COM_MSG_CHIP_SELECT == msg) && arg_val)
+		spi_acquire(&spi_display);
+
+	res = U8G_COM_ST7920_HW_SPI(u8g, msg, arg_val, arg_ptr);
+
+	if((U8G_COM_MSG_CHIP_SELECT == msg) && !arg_val)
+		spi_release(&spi_display);
+
+	return res;
+}
@@ -0,0 +1,29 @@
+#ifndef SPI_H
+#define SPI_H
+
+// SPI device descriptor
+
+typedef struct {
+	uint8_t spcr;								// SPCR value (mode and clock rate)
+	uint8_t spsr;								// SPSR value (SPI2X)
+	volatile uint8_t *cs_port;					// Chip select port, NULL if not managed here
+	uint8_t cs_mask;							// Chip select bit mask
+	uint8_t cs_active_high;						// TRUE if chip select is active high
+} spi_device_t;
+
+// Display device on the shared bus
+
+extern u8g_dev_t u8g_dev_st7920_128x64_shared_spi;
+
+// Methods
+
+void spi_init(void);
+void spi_add_device(const spi_device_t *dev, volatile uint8_t *cs_ddr);
+bool spi_try_acquire(const spi_device_t *dev);
+void spi_acquire(const spi_device_t *dev);
+void spi_release(const spi_device_t *dev);
+void spi_select(const spi_device_t *dev, bool state);
+uint8_t spi_transfer(uint8_t out_byte);
+uint8_t u8g_com_st7920_shared_spi_fn(u8g_t *u8g, uint8_t msg, uint8_t arg_val, void *arg_ptr);
+
+#endif
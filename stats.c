@@ -0,0 +1,234 @@
+//
+//		stats.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Windowed measurement statistics
+ *
+ * Keeps the min, max, mean and variance of each quantity over three
+ * windows (see config.h). A sample only updates the shortest window's
+ * accumulator. When a window closes, its accumulator becomes the result
+ * for that window and is merged into the next longer window, so the cost
+ * per sample is constant whatever the window lengths.
+ *
+ * Values are stored biased to unsigned 16 bits, so the sums don't depend
+ * on the sign of the quantity. The sum of squares needs 64 bits for the
+ * long window.
+ */
+
+#include "includes.h"
+
+#ifdef METER_STATS
+
+#define STATS_BIAS 0x8000
+
+// Accumulator
+typedef struct {
+	uint16_t min;								// Minimum (biased)
+	uint16_t max;								// Maximum (biased)
+	uint32_t sum;								// Sum of samples (biased)
+	uint64_t sumsq;								// Sum of squares (biased)
+	uint16_t count;								// Number of samples
+} stats_acc_t;
+
+// Result of a completed window
+typedef struct {
+	uint16_t min;								// Minimum (biased)
+	uint16_t max;								// Maximum (biased)
+	uint16_t mean;								// Mean (biased)
+	uint32_t var;								// Variance
+	uint16_t count;								// Number of samples
+} stats_res_t;
+
+// Window lengths in seconds
+static const uint16_t stats_secs[STATS_WINDOWS] PROGMEM = {
+	STATS_WINDOW0, STATS_WINDOW1, STATS_WINDOW2
+};
+
+// Bit per quantity with a signed value
+#define STATS_SIGNED (_BV(STATS_KW) | _BV(STATS_KVA) | _BV(STATS_PF))
+
+static stats_acc_t stats_acc[STATS_WINDOWS][STATS_QUANTITIES];
+static stats_res_t stats_res[STATS_WINDOWS][STATS_QUANTITIES];
+static uint32_t stats_start[STATS_WINDOWS];		// Tick count when each window started
+
+/*
+ * Empty an accumulator
+ */
+ 
+static void stats_clear(stats_acc_t *acc)
+{
+	memset(acc, 0, sizeof(stats_acc_t));
+	acc->min = 0xFFFF;
+}
+
+/*
+ * Merge an accumulator into another
+ *
+ * Saturates like stats_sample: once the destination would pass 0xFFFF
+ * samples only min and max are merged, so sum cannot overflow 32 bits.
+ */
+ 
+static void stats_merge(stats_acc_t *dest, const stats_acc_t *src)
+{
+	if(!src->count)
+		return;
+	if(src->min < dest->min)
+		dest->min = src->min;
+	if(src->max > dest->max)
+		dest->max = src->max;
+	if(((uint32_t) dest->count + src->count) > 0xFFFF)
+		return;
+	dest->sum += src->sum;
+	dest->sumsq += src->sumsq;
+	dest->count += src->count;
+}
+
+/*
+ * Close a window: its accumulators become its results, and are merged
+ * into the next window.
+ */
+
+static void stats_close(uint8_t w)
+{
+	uint8_t q;
+	stats_acc_t *acc;
+	stats_res_t *res;
+	uint64_t n;
+	
+	for(q = 0; q < STATS_QUANTITIES; q++){
+		acc = &stats_acc[w][q];
+		res = &stats_res[w][q];
+		n = acc->count;
+		res->count = acc->count;
+		if(n){
+			res->min = acc->min;
+			res->max = acc->max;
+			res->mean = (uint16_t) ((acc->sum + (n >> 1)) / n);
+			// n * sumsq - sum^2 is exact, and fits in 64 bits for up to 
+			// 65535 samples
+			res->var = (uint32_t) ((n * acc->sumsq - (uint64_t) acc->sum * acc->sum) / (n * n));
+		}
+		if(w + 1 < STATS_WINDOWS)
+			stats_merge(&stats_acc[w + 1][q], acc);
+		stats_clear(acc);
+	}
+}
+
+/*
+ * Discard all statistics and restart the windows
+ */
+ 
+void stats_reset(void)
+{
+	uint8_t w, q;
+	uint32_t now = timer0_ticks();
+	
+	for(w = 0; w < STATS_WINDOWS; w++){
+		for(q = 0; q < STATS_QUANTITIES; q++)
+			stats_clear(&stats_acc[w][q]);
+		stats_start[w] = now;
+	}
+	memset(stats_res, 0, sizeof(stats_res));
+}
+
+/*
+ * Add a sample of a quantity
+ */
+ 
+void stats_sample(uint8_t quantity, int32_t value)
+{
+	stats_acc_t *acc;
+	uint16_t v;
+	
+	if(quantity >= STATS_QUANTITIES)
+		return;
+	acc = &stats_acc[STATS_WIN0][quantity];
+	if(0xFFFF == acc->count)
+		return;
+		
+	v = (uint16_t) ((STATS_SIGNED & _BV(quantity)) ? value + STATS_BIAS : value);
+	if(v < acc->min)
+		acc->min = v;
+	if(v > acc->max)
+		acc->max = v;
+	acc->sum += v;
+	acc->sumsq += (uint32_t) v * v;
+	acc->count++;
+}
+
+/*
+ * Close the windows which are due. Call often.
+ */
+ 
+void stats_service(void)
+{
+	uint8_t w;
+	uint32_t now = timer0_ticks();
+	uint32_t len;
+	
+	for(w = 0; w < STATS_WINDOWS; w++){
+		len = timer0_ms_to_ticks(pgm_read_word(&stats_secs[w]) * 1000UL);
+		if((now - stats_start[w]) < len)
+			break; // Longer windows can't be due either
+		stats_close(w);
+		stats_start[w] += len;
+		// Catch up after a long stall
+		if((now - stats_start[w]) >= len)
+			stats_start[w] = now;
+	}
+}
+
+/*
+ * Get the statistics of the last completed window of a quantity.
+ * 
+ * Returns FALSE if there is no completed window with samples yet.
+ */
+ 
+bool stats_get(uint8_t window, uint8_t quantity, stats_result_t *res)
+{
+	const stats_res_t *r;
+	int32_t bias;
+	
+	if((window >= STATS_WINDOWS) || (quantity >= STATS_QUANTITIES))
+		return FALSE;
+	r = &stats_res[window][quantity];
+	bias = (STATS_SIGNED & _BV(quantity)) ? STATS_BIAS : 0;
+	res->count = r->count;
+	res->min = (int32_t) r->min - bias;
+	res->max = (int32_t) r->max - bias;
+	res->mean = (int32_t) r->mean - bias;
+	res->var = r->var;
+	return (r->count > 0);
+}
+
+/*
+ * Return the length of a window in seconds
+ */
+ 
+uint16_t stats_window_secs(uint8_t window)
+{
+	if(window >= STATS_WINDOWS)
+		return 0;
+	return pgm_read_word(&stats_secs[window]);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Quantities
+
+enum {STATS_VRMS = 0, STATS_IRMS, STATS_KW, STATS_KVA, STATS_PF, STATS_HZ, STATS_QUANTITIES};
+
+// Windows, shortest first
+
+enum {STATS_WIN0 = 0, STATS_WIN1, STATS_WIN2, STATS_WINDOWS};
+
+// Statistics of a completed window, in the quantity's fixed point units
+
+typedef struct {
+	int32_t min;								// Minimum
+	int32_t max;								// Maximum
+	int32_t mean;								// Mean
+	uint32_t var;								// Variance (units squared)
+	uint16_t count;								// Number of samples, 0 if none
+} stats_result_t;
+
+// Methods
+
+void stats_reset(void);
+void stats_sample(uint8_t quantity, int32_t value);
+void stats_service(void);
+bool stats_get(uint8_t window, uint8_t quantity, stats_result_t *res);
+uint16_t stats_window_secs(uint8_t window);
+
+#endif
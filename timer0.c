@@ -44,10 +44,55 @@ void timer0_future_ms(uint32_t msec, uint64_t *future)
 		*future = now + msec;
 	else{
 		x = (msec * 1000ULL) / 1024ULL;
-		*future = x;
+		*future = now + x;
 	}
 }
 
+/*
+ * Return the low 32 bits of the tick counter
+ */
+ 
+uint32_t timer0_ticks(void)
+{
+	uint32_t now;
+	
+	// Critical section start
+	cli();
+	now = (uint32_t) timer0_ticks64;
+	sei();
+	// Critical section end
+	
+	return now;
+}
+
+/*
+ * Return the time since power up in seconds
+ */
+ 
+uint32_t timer0_seconds(void)
+{
+	uint64_t now;
+	
+	// Critical section start
+	cli();
+	now = timer0_ticks64;
+	sei();
+	// Critical section end
+	
+	// A tick is 1.024ms, 16/15625 seconds
+	return (uint32_t) ((now * 16ULL) / 15625ULL);
+}
+
+/*
+ * Convert milliseconds to ticks
+ */
+ 
+uint32_t timer0_ms_to_ticks(uint32_t msec)
+{
+	// A tick is 1.024ms, 125/128 ticks per millisecond
+	return (msec * 125UL) >> 7;
+}
+
 /*
  * Test a future delay time or time out
  */
@@ -92,9 +137,17 @@ void timer0_elapsed_time(char *elap, uint8_t size)
 	now = timer0_ticks64;
 	sei();
 	
-	now *= 10000;
-	now /= 9765;
-	// FIXME: Small printf doesn't seem to support uint64_t
+	timer0_ticks_to_elapsed_time(now, elap, size);
+}
+
+/*
+ * Make an elapsed time string from a saved tick count
+ */
+
+void timer0_ticks_to_elapsed_time(uint64_t ticks, char *elap, uint8_t size)
+{
+	ticks *= 10000;
+	ticks /= 9765;
 	// elapsed time will overflow after appx. 1149 power on hrs.
-	snprintf_P(elap, size, PSTR("%lu"), (uint32_t) now);
+	fixfmt(elap, size, (uint32_t) ticks, FALSE, 0, 1, 0);
 }
@@ -4,8 +4,12 @@
 extern volatile uint64_t timer0_ticks64;
 
 void timer0_future_ms(uint32_t msec, uint64_t *future);
+uint32_t timer0_ticks(void);
+uint32_t timer0_seconds(void);
+uint32_t timer0_ms_to_ticks(uint32_t msec);
 int timer0_test_future_ms(uint64_t *future);
 void timer0_delay_ms(uint32_t value);
 void timer0_elapsed_time(char *elap, uint8_t size);
+void timer0_ticks_to_elapsed_time(uint64_t ticks, char *elap, uint8_t size);
 
 #endif
@@ -0,0 +1,152 @@
+//
+//		tou.c
+//
+//		Copyright 2015 Stephen Rodgers
+//
+//      This program is free software; you can redistribute it and/or modify
+//      it under the terms of the GNU General Public License as published by
+//      the Free Software Foundation; either version 3 of the License, or
+//      (at your option) any later version.
+//      
+//      This program is distributed in the hope that it will be useful,
+//      but WITHOUT ANY WARRANTY; without even the implied warranty of
+//      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//      GNU General Public License for more details.
+//      
+//      You should have received a copy of the GNU General Public License
+//      along with this program; if not, write to the Free Software
+//      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+//      MA 02110-1301, USA.
+//      
+//
+
+/*
+ * Time of use tariff schedule
+ *
+ * Each day type (weekday or weekend) has a rate for every TOU_SLOT_MIN
+ * minutes of the day, 2 bits per slot, saved in EEPROM. The time of day 
+ * comes from a software clock: the host sets the local time in seconds
+ * since 1970, and the clock runs on from the timer0 tick count. Until it
+ * is set, everything is at the first rate.
+ */
+
+#include "includes.h"
+
+#define TOU_SLOTS_PER_BYTE 4
+
+typedef struct {
+	uint16_t sig;								// EEPROM signature for the schedule
+	uint8_t map[TOU_DAYTYPES][TOU_SLOTS / TOU_SLOTS_PER_BYTE];	// Rate of each slot
+	uint16_t crc;								// CRC of the schedule
+} eeprom_tou_t;
+
+static eeprom_tou_t EEMEM eetou_eemem;
+
+static eeprom_tou_t tou;
+static uint32_t tou_base;						// Clock seconds at timer0 second zero
+static bool tou_synced;							// TRUE once the clock is set
+static bool tou_rate_valid;						// FALSE when tou_rate_now must be worked out again
+static uint8_t tou_rate_now;					// Rate of the current slot
+static uint32_t tou_rate_due;					// Tick count when the current slot ends
+
+/*
+ * Load the schedule
+ */
+ 
+void tou_init(void)
+{
+	eeprom_read_block(&tou, &eetou_eemem, sizeof(tou));
+	if((0x55AA != tou.sig) || (calcCRC16(&tou, sizeof(tou) - sizeof(uint16_t)) != tou.crc)){
+		memset(&tou, 0, sizeof(tou));
+		tou.sig = 0x55AA;
+	}
+}
+
+/*
+ * Set the clock to local time in seconds since 1970
+ */
+ 
+void tou_set_clock(uint32_t secs)
+{
+	tou_base = secs - timer0_seconds();
+	tou_synced = TRUE;
+	tou_rate_valid = FALSE;
+}
+
+/*
+ * Get the clock
+ * 
+ * Returns FALSE if it has not been set
+ */
+ 
+bool tou_get_clock(uint32_t *secs)
+{
+	*secs = tou_base + timer0_seconds();
+	return tou_synced;
+}
+
+/*
+ * Return the rate of a schedule slot
+ */
+ 
+uint8_t tou_get_slot(uint8_t daytype, uint8_t slot)
+{
+	if((daytype >= TOU_DAYTYPES) || (slot >= TOU_SLOTS))
+		return 0;
+	return (tou.map[daytype][slot / TOU_SLOTS_PER_BYTE] >> ((slot % TOU_SLOTS_PER_BYTE) << 1)) & 0x03;
+}
+
+/*
+ * Set the rate of the slots from one up to (not including) another,
+ * wrapping past midnight if to is before from. Saves the schedule.
+ */
+ 
+void tou_set_slots(uint8_t daytype, uint8_t from, uint8_t to, uint8_t rate)
+{
+	uint8_t *b;
+	uint8_t shift;
+	
+	if((daytype >= TOU_DAYTYPES) || (from >= TOU_SLOTS) || (to > TOU_SLOTS) || (rate >= TOU_RATES))
+		return;
+	do{
+		b = &tou.map[daytype][from / TOU_SLOTS_PER_BYTE];
+		shift = (from % TOU_SLOTS_PER_BYTE) << 1;
+		*b = (*b & ~(0x03 << shift)) | (rate << shift);
+		if(++from >= TOU_SLOTS)
+			from = 0;
+	} while(from != (to % TOU_SLOTS));
+	
+	tou.crc = calcCRC16(&tou, sizeof(tou) - sizeof(uint16_t));
+	eeprom_update_block(&tou, &eetou_eemem, sizeof(tou));
+	tou_rate_valid = FALSE;
+}
+
+/*
+ * Return the rate in effect now
+ * 
+ * The rate only changes at a slot boundary, so it is worked out once per
+ * slot, and in between costs a tick count compare instead of the 64 bit
+ * divide in timer0_seconds().
+ */
+ 
+uint8_t tou_rate(void)
+{
+	uint32_t now, days, secs;
+	uint32_t ticks = timer0_ticks();
+	uint8_t dow;
+	
+	if(!tou_synced)
+		return 0;
+	if(tou_rate_valid && ((int32_t) (ticks - tou_rate_due) < 0))
+		return tou_rate_now;
+	now = tou_base + timer0_seconds();
+	days = now / 86400UL;
+	secs = now - (days * 86400UL);
+	// 1 January 1970 was a Thursday, day 4 with Sunday as day 0
+	dow = (uint8_t) ((days + 4) % 7);
+	tou_rate_now = tou_get_slot(((0 == dow) || (6 == dow)) ? TOU_WEEKEND : TOU_WEEKDAY,
+		(uint8_t) (secs / (TOU_SLOT_MIN * 60UL)));
+	tou_rate_due = ticks + timer0_ms_to_ticks(((TOU_SLOT_MIN * 60UL) - (secs % (TOU_SLOT_MIN * 60UL))) * 1000UL);
+	tou_rate_valid = TRUE;
+	return tou_rate_now;
+}
@@ -0,0 +1,21 @@
+#ifndef TOU_H
+#define TOU_H
+
+// Rates, day types and schedule slots
+
+#define TOU_RATES 4
+#define TOU_SLOT_MIN 15							// Minutes per schedule slot
+#define TOU_SLOTS (1440 / TOU_SLOT_MIN)			// Schedule slots per day
+
+enum {TOU_WEEKDAY = 0, TOU_WEEKEND, TOU_DAYTYPES};
+
+// Methods
+
+void tou_init(void);
+void tou_set_clock(uint32_t secs);
+bool tou_get_clock(uint32_t *secs);
+uint8_t tou_rate(void);
+uint8_t tou_get_slot(uint8_t daytype, uint8_t slot);
+void tou_set_slots(uint8_t daytype, uint8_t from, uint8_t to, uint8_t rate);
+
+#endif
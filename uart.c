@@ -572,6 +572,8 @@ void uart0_init(uint16_t baudrate)
 		UART0_STATUS = (1<<U2X);  //Enable 2x speed
 		baudrate &= ~0x8000;
 	}
+	else
+		UART0_STATUS &= ~(1<<U2X);  //Single speed, may have been doubled before
 	UBRRH = (uint8_t)(baudrate>>8);
 	UBRRL = (uint8_t) baudrate;
 
@@ -591,6 +593,8 @@ void uart0_init(uint16_t baudrate)
 		UART0_STATUS = (1<<U2X0);  //Enable 2x speed
 		baudrate &= ~0x8000;
 	}
+	else
+		UART0_STATUS &= ~(1<<U2X0);  //Single speed, may have been doubled before
 	UBRR0H = (uint8_t)(baudrate>>8);
 	UBRR0L = (uint8_t) baudrate;
 
@@ -610,6 +614,8 @@ void uart0_init(uint16_t baudrate)
 		UART0_STATUS = (1<<U2X);  //Enable 2x speed
 		baudrate &= ~0x8000;
 	}
+	else
+		UART0_STATUS &= ~(1<<U2X);  //Single speed, may have been doubled before
 	UBRRHI = (uint8_t)(baudrate>>8);
 	UBRR   = (uint8_t) baudrate;
 
@@ -699,6 +705,33 @@ void uart0_putc(uint8_t data)
 } /* uart0_putc */
 
 
+/*************************************************************************
+Function: uart0_write()
+Purpose:  Copy a block of bytes into the ringbuffer for transmitting
+Input:    bytes to be transmitted, and how many
+Returns:  none
+**************************************************************************/
+void uart0_write(const void *data, uint8_t len)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	uint16_t tmphead;
+
+	while (len--) {
+		tmphead = (UART_TxHead + 1) & UART_TX0_BUFFER_MASK;
+		while ( tmphead == UART_TxTail ) {
+			/* wait for free space in buffer, it only frees up while sending */
+			UART0_CONTROL |= _BV(UART0_UDRIE);
+		}
+		UART_TxBuf[tmphead] = *p++;
+		UART_TxHead = tmphead;
+	}
+
+	/* enable UDRE interrupt once for the block */
+	UART0_CONTROL    |= _BV(UART0_UDRIE);
+
+} /* uart0_write */
+
+
 /*************************************************************************
 Function: uart0_puts()
 Purpose:  transmit string to UART
@@ -743,6 +776,17 @@ uint16_t uart0_available(void)
 	return (UART_RX0_BUFFER_SIZE + UART_RxHead - UART_RxTail) & UART_RX0_BUFFER_MASK;
 } /* uart0_available */
 
+/*************************************************************************
+Function: uart0_tx_space()
+Purpose:  Determine the free space in the transmit buffer
+Input:    None
+Returns:  Integer number of bytes which can be written without blocking
+**************************************************************************/
+uint16_t uart0_tx_space(void)
+{
+	return (UART_TX0_BUFFER_SIZE + UART_TxTail - UART_TxHead - 1) & UART_TX0_BUFFER_MASK;
+} /* uart0_tx_space */
+
 /*************************************************************************
 Function: uart0_flush()
 Purpose:  Flush bytes waiting the receive buffer.  Acutally ignores them.
@@ -113,7 +113,8 @@ Date        Description
  * constants and macros
  */
  
-#define UART_RX0_BUFFER_SIZE 16
+// The receive buffer holds characters until the main loop moves them to the JSON command queue
+#define UART_RX0_BUFFER_SIZE 64
 #define UART_TX0_BUFFER_SIZE 256
 
 /* Enable USART 1, 2, 3 as required */
@@ -307,6 +308,18 @@ extern uint16_t uart0_peek(void);
  */
 extern void uart0_putc(uint8_t data);
 
+/**
+ *  @brief   Put a block of bytes to ringbuffer for transmitting via UART
+ *
+ *  Blocks if the block doesn't fit in the circular buffer. Check with
+ *  uart0_tx_space() first to avoid that.
+ *
+ *  @param   data bytes to be transmitted
+ *  @param   len number of bytes
+ *  @return  none
+ */
+extern void uart0_write(const void *data, uint8_t len);
+
 
 /**
  *  @brief   Put string to ringbuffer for transmitting via UART
@@ -347,6 +360,12 @@ extern void uart0_puts_p(const char *s );
  */
 extern uint16_t uart0_available(void);
 
+/**
+ *  @brief   Return free space in the transmit buffer
+ *  @return  bytes which can be written without blocking
+ */
+extern uint16_t uart0_tx_space(void);
+
 /**
  *  @brief   Flush bytes waiting in receive buffer
  */
@@ -35,16 +35,65 @@ static int uartstream_getchar(FILE *stream);
 
 static FILE uartstream_stdout = FDEV_SETUP_STREAM(uartstream_putchar, uartstream_getchar, _FDEV_SETUP_RW);
 
+// Current baud rate
+
+static uint32_t uartstream_baud;
+
+/*
+ * Return the magnitude of the error of a baud rate divisor
+ */
+ 
+static uint32_t uartstream_baud_error(uint32_t baudrate, uint32_t divisor)
+{
+	uint32_t actual = F_CPU / divisor;
+	
+	return (actual > baudrate) ? actual - baudrate : baudrate - actual;
+}
+
+/*
+ * Set up the UART for a baud rate. Double speed halves the divisor 
+ * granularity, so use it when it gets closer to the rate (e.g. 2.1% 
+ * instead of 3.5% at 115200 with a 16MHz clock).
+ */
+ 
+static void uartstream_uart_init(uint32_t baudrate)
+{
+	uint16_t single = UART_BAUD_SELECT(baudrate, F_CPU);
+	uint16_t dbl = UART_BAUD_SELECT_DOUBLE_SPEED(baudrate, F_CPU);
+	
+	if(uartstream_baud_error(baudrate, 8UL * ((dbl & ~0x8000) + 1)) < 
+	uartstream_baud_error(baudrate, 16UL * (single + 1)))
+		uart0_init(dbl);
+	else
+		uart0_init(single);
+	uartstream_baud = baudrate;
+}
+
 /*
  * Initialize the file handle, return the file handle
  */
 
 FILE *uartstream_init(uint32_t baudrate)
 {
-	uart0_init(UART_BAUD_SELECT(baudrate, F_CPU));
+	uartstream_uart_init(baudrate);
 	return &uartstream_stdout;
 }	
 
+/*
+ * Change the baud rate. 
+ * 
+ * Waits for the transmit buffer to empty, and for two more character 
+ * times for the last character to leave the shift register, so 
+ * everything queued goes out at the old rate.
+ */
+ 
+void uartstream_set_baud(uint32_t baudrate)
+{
+	while(uart0_tx_space() < (UART_TX0_BUFFER_SIZE - 1));
+	timer0_delay_ms((20000UL / uartstream_baud) + 1);
+	uartstream_uart_init(baudrate);
+}
+
 /*
  * Write a char to the UART
  */
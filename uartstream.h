@@ -3,6 +3,7 @@
 
 
 FILE *uartstream_init(uint32_t baudrate);
+void uartstream_set_baud(uint32_t baudrate);
 
 #endif
 